@@ -0,0 +1,475 @@
+﻿/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+
+#include "job.h"
+#include "logging.h"
+#include "job_pool.h"
+#include "converting.h"
+#include "thread_pool.h"
+#include "thread_worker.h"
+#include "messaging_client.h"
+#include "messaging_server.h"
+
+#include "container.h"
+#include "values/long_value.h"
+#include "values/string_value.h"
+
+#include "fmt/xchar.h"
+#include "fmt/format.h"
+
+#include "benchmark/benchmark.h"
+
+constexpr auto PROGRAM_NAME = L"benchmarks";
+
+using namespace std;
+using namespace logging;
+using namespace threads;
+using namespace network;
+using namespace container;
+using namespace converting;
+
+wstring connection_key = L"benchmark_network";
+unsigned short loopback_port = 9900;
+unsigned short reply_timeout = 10000;
+
+class loopback
+{
+public:
+	bool start(void)
+	{
+		_server = make_shared<messaging_server>(L"benchmark_server");
+		_server->set_connection_key(connection_key);
+		_server->set_possible_session_types({ session_types::message_line });
+		_server->set_message_notification(
+			[server = _server.get()](shared_ptr<value_container> container)
+			{
+				container->swap_header();
+				server->send(container);
+			});
+		_server->start(loopback_port, 1, 1, 1);
+
+		_client = make_shared<messaging_client>(L"benchmark_client");
+		_client->set_connection_key(connection_key);
+		_client->set_session_types({ session_types::message_line });
+		_client->set_connection_notification(
+			[this](const wstring& target_id, const wstring& target_sub_id, const bool& condition)
+			{
+				{
+					scoped_lock<mutex> guard(_mutex);
+
+					_connected = condition;
+					_target_id = target_id;
+					_target_sub_id = target_sub_id;
+				}
+
+				_condition.notify_all();
+			});
+		_client->set_message_notification(
+			[this](shared_ptr<value_container> container)
+			{
+				{
+					scoped_lock<mutex> guard(_mutex);
+
+					++_replies;
+				}
+
+				_condition.notify_all();
+			});
+		_client->start(L"127.0.0.1", loopback_port, 1, 1, 1);
+
+		unique_lock<mutex> lock(_mutex);
+
+		return _condition.wait_for(lock, chrono::milliseconds(reply_timeout), [this]() { return _connected; });
+	}
+
+	void stop(void)
+	{
+		if (_client != nullptr)
+		{
+			_client->stop();
+			_client.reset();
+		}
+
+		if (_server != nullptr)
+		{
+			_server->stop();
+			_server.reset();
+		}
+	}
+
+	shared_ptr<value_container> create_message(const size_t& payload_size)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		return make_shared<value_container>(_target_id, _target_sub_id, L"echo_test", vector<shared_ptr<value>> 
+			{
+				make_shared<string_value>(L"payload", wstring(payload_size, L'x'))
+			});
+	}
+
+	bool send(shared_ptr<value_container> message)
+	{
+		return _client->send(message);
+	}
+
+	int64_t replies(void)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		return _replies;
+	}
+
+	bool wait_replies(const int64_t& count)
+	{
+		unique_lock<mutex> lock(_mutex);
+
+		return _condition.wait_for(lock, chrono::milliseconds(reply_timeout), [this, &count]() { return _replies >= count; });
+	}
+
+private:
+	shared_ptr<messaging_server> _server;
+	shared_ptr<messaging_client> _client;
+	mutex _mutex;
+	condition_variable _condition;
+	bool _connected = false;
+	wstring _target_id;
+	wstring _target_sub_id;
+	int64_t _replies = 0;
+};
+
+loopback _loopback;
+bool loopback_ready = false;
+int64_t loopback_replies = 0;
+
+shared_ptr<value_container> create_container(const int64_t& field_count);
+shared_ptr<value_container> create_publish(void);
+shared_ptr<thread_pool> create_thread_pool(void);
+
+void container_build(benchmark::State& state);
+void container_serialize(benchmark::State& state);
+void container_parse(benchmark::State& state);
+void container_to_json(benchmark::State& state);
+void publish_fan_out(benchmark::State& state);
+void publish_fan_out_copy(benchmark::State& state);
+void thread_pool_dispatch(benchmark::State& state);
+void logger_write(benchmark::State& state);
+void loopback_echo(benchmark::State& state);
+void loopback_send(benchmark::State& state);
+
+BENCHMARK(container_build)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(container_serialize)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(container_parse)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(container_to_json)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(publish_fan_out)->Arg(1)->Arg(100)->Arg(10000);
+BENCHMARK(publish_fan_out_copy)->Arg(1)->Arg(100)->Arg(10000);
+BENCHMARK(thread_pool_dispatch)->ArgsProduct({ { 0, 1, 2 }, { 1000 } })->UseRealTime();
+BENCHMARK(logger_write)->Threads(10)->UseRealTime();
+BENCHMARK(loopback_echo)->Arg(16)->Arg(4096)->UseRealTime();
+BENCHMARK(loopback_send)->Arg(16)->Threads(64)->UseRealTime();
+
+int main(int argc, char* argv[])
+{
+	// the results are written to benchmarks.json as well unless --benchmark_out is given,
+	// so the runs of two commits can be compared with compare.py of google benchmark
+	string out_option = "--benchmark_out=benchmarks.json";
+	string format_option = "--benchmark_out_format=json";
+
+	vector<char*> arguments(argv, argv + argc);
+	if (none_of(arguments.begin(), arguments.end(), 
+		[](char* argument) { return string(argument).rfind("--benchmark_out=", 0) == 0; }))
+	{
+		arguments.push_back(out_option.data());
+		arguments.push_back(format_option.data());
+	}
+
+	int count = (int)arguments.size();
+	benchmark::Initialize(&count, arguments.data());
+	if (benchmark::ReportUnrecognizedArguments(count, arguments.data()))
+	{
+		return 1;
+	}
+
+	logger::handle().set_write_console(logging_styles::file_only);
+	logger::handle().set_target_level(logging_level::information);
+	logger::handle().start(PROGRAM_NAME);
+
+	// one messaging_server and messaging_client pair is shared by the network benchmarks
+	loopback_ready = _loopback.start();
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	_loopback.stop();
+
+	logger::handle().stop();
+
+	return 0;
+}
+
+shared_ptr<value_container> create_container(const int64_t& field_count)
+{
+	auto data = make_shared<value_container>(L"benchmark", vector<shared_ptr<value>>{});
+	for (int64_t index = 0; index < field_count; ++index)
+	{
+		data->add(make_shared<long_value>(fmt::format(L"long_value_{}", index), (long)index));
+	}
+	data->add(make_shared<string_value>(L"string_value", L"테스트_benchmark"));
+
+	return data;
+}
+
+shared_ptr<value_container> create_publish(void)
+{
+	return make_shared<value_container>(L"publisher", L"", L"echo_server", L"", L"publish", vector<shared_ptr<value>> 
+		{
+			make_shared<string_value>(L"topic", L"benchmark"),
+			make_shared<string_value>(L"payload", wstring(1024, L'x'))
+		});
+}
+
+shared_ptr<thread_pool> create_thread_pool(void)
+{
+	auto pool = make_shared<thread_pool>();
+	pool->append(make_shared<thread_worker>(priorities::high));
+	pool->append(make_shared<thread_worker>(priorities::normal, vector<priorities> { priorities::high }));
+	pool->append(make_shared<thread_worker>(priorities::low, vector<priorities> { priorities::high, priorities::normal }));
+	pool->start();
+
+	return pool;
+}
+
+void container_build(benchmark::State& state)
+{
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(create_container(state.range(0)));
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void container_serialize(benchmark::State& state)
+{
+	auto data = create_container(state.range(0));
+
+	size_t size = 0;
+	for (auto _ : state)
+	{
+		wstring serialized = data->serialize();
+		size = serialized.size();
+		benchmark::DoNotOptimize(serialized);
+	}
+
+	state.SetBytesProcessed(state.iterations() * size * sizeof(wchar_t));
+}
+
+void container_parse(benchmark::State& state)
+{
+	wstring serialized = create_container(state.range(0))->serialize();
+
+	for (auto _ : state)
+	{
+		value_container parsed(serialized, false);
+		benchmark::DoNotOptimize(parsed.get_value(L"string_value"));
+	}
+
+	state.SetBytesProcessed(state.iterations() * serialized.size() * sizeof(wchar_t));
+}
+
+void container_to_json(benchmark::State& state)
+{
+	auto data = create_container(state.range(0));
+
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(data->to_json());
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void publish_fan_out(benchmark::State& state)
+{
+	// the same fan-out as received_publish of echo_server, where every subscriber message
+	// shares the published values and only gets its own header before it is serialized to be sent
+	auto published = create_publish();
+	int64_t subscriber_count = state.range(0);
+
+	for (auto _ : state)
+	{
+		vector<shared_ptr<value>> units = published->value_array(L"topic");
+		auto payload = published->value_array(L"payload");
+		units.insert(units.end(), payload.begin(), payload.end());
+
+		for (int64_t index = 0; index < subscriber_count; ++index)
+		{
+			auto message = make_shared<value_container>(published->source_id(), published->source_sub_id(),
+				L"subscriber", fmt::format(L"{}", index), L"publish", units);
+			benchmark::DoNotOptimize(message->serialize());
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * subscriber_count);
+}
+
+void publish_fan_out_copy(benchmark::State& state)
+{
+	// the fan-out before received_publish shared the values, which copies the whole container per subscriber
+	auto published = create_publish();
+	int64_t subscriber_count = state.range(0);
+
+	for (auto _ : state)
+	{
+		for (int64_t index = 0; index < subscriber_count; ++index)
+		{
+			auto message = published->copy();
+			message->set_target(L"subscriber", fmt::format(L"{}", index));
+			benchmark::DoNotOptimize(message->serialize());
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * subscriber_count);
+}
+
+void thread_pool_dispatch(benchmark::State& state)
+{
+	// every priority has one worker, and the normal and low workers also take higher priorities as the samples do
+	const vector<priorities> priority_list = { priorities::high, priorities::normal, priorities::low };
+	const vector<string> priority_names = { "high", "normal", "low" };
+
+	auto priority = priority_list[state.range(0)];
+	int64_t job_count = state.range(1);
+
+	auto pool = create_thread_pool();
+
+	for (auto _ : state)
+	{
+		atomic<int64_t> remaining{ job_count };
+		promise<void> completed;
+
+		auto callback = [&remaining, &completed]()
+		{
+			if (remaining.fetch_sub(1) == 1)
+			{
+				completed.set_value();
+			}
+		};
+
+		for (int64_t index = 0; index < job_count; ++index)
+		{
+			pool->push(make_shared<job>(priority, callback));
+		}
+
+		completed.get_future().wait();
+	}
+
+	pool->stop();
+
+	state.SetItemsProcessed(state.iterations() * job_count);
+	state.SetLabel(priority_names[state.range(0)]);
+}
+
+void logger_write(benchmark::State& state)
+{
+	// runs on 10 threads at once like logging_sample
+	int64_t index = 0;
+	for (auto _ : state)
+	{
+		logger::handle().write(logging_level::information, 
+			fmt::format(L"테스트_in_thread_{}: {}", state.thread_index(), index++));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+void loopback_echo(benchmark::State& state)
+{
+	if (!loopback_ready)
+	{
+		state.SkipWithError("cannot connect to the loopback messaging_server");
+	}
+
+	auto message = _loopback.create_message(state.range(0));
+
+	int64_t replies = _loopback.replies();
+	for (auto _ : state)
+	{
+		_loopback.send(message);
+		if (!_loopback.wait_replies(++replies))
+		{
+			state.SkipWithError("an echo reply is not received in time");
+
+			break;
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+void loopback_send(benchmark::State& state)
+{
+	// 64 threads send on one connection at once to measure the contention of send,
+	// and the replies are only counted after the measured loop
+	if (!loopback_ready)
+	{
+		state.SkipWithError("cannot connect to the loopback messaging_server");
+	}
+
+	if (state.thread_index() == 0)
+	{
+		loopback_replies = _loopback.replies();
+	}
+
+	auto message = _loopback.create_message(state.range(0));
+
+	for (auto _ : state)
+	{
+		_loopback.send(message);
+	}
+
+	state.SetItemsProcessed(state.iterations());
+
+	if (state.thread_index() == 0 && loopback_ready)
+	{
+		// every thread has left the measured loop here, so iterations of all threads are the sent messages
+		state.counters["replied"] = _loopback.wait_replies(loopback_replies + state.iterations() * state.threads()) ? 1 : 0;
+	}
+}
\ No newline at end of file
@@ -31,6 +31,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *****************************************************************************/
 
 #include "logging.h"
+#include "file_handler.h"
 #include "argument_parser.h"
 
 #include "container.h"
@@ -56,6 +57,7 @@ constexpr auto PROGRAM_NAME = L"container_sample";
 using namespace logging;
 using namespace container;
 using namespace converting;
+using namespace file_handler;
 using namespace argument_parser;
 
 #ifdef _DEBUG
@@ -65,9 +67,15 @@ logging_styles logging_style = logging_styles::console_only;
 logging_level log_level = logging_level::information;
 logging_styles logging_style = logging_styles::file_only;
 #endif
+unsigned short field_count = 0;
+wstring golden_folder = L"";
+bool record_golden = false;
 
 bool parse_arguments(argument_manager& arguments);
 void display_help(void);
+bool verify_round_trip(value_container& source);
+bool verify_golden(value_container& source, const wstring& name);
+bool verify_golden(const wstring& output, const wstring& file_name);
 
 int main(int argc, char* argv[])
 {
@@ -119,9 +127,144 @@ int main(int argc, char* argv[])
 	logger::handle().write(logging_level::information, fmt::format(L"data xml:\n{}", data3.to_xml()), start);
 	logger::handle().write(logging_level::information, fmt::format(L"data json:\n{}", data3.to_json()), start);
 
+	bool identical = verify_round_trip(data);
+	identical = verify_round_trip(data2) && identical;
+	identical = verify_round_trip(data3) && identical;
+
+	if (!golden_folder.empty())
+	{
+		identical = verify_golden(data, L"data") && identical;
+		identical = verify_golden(data2, L"data2") && identical;
+		identical = verify_golden(data3, L"data3") && identical;
+	}
+
+	if (field_count > 0)
+	{
+		vector<wstring> names;
+		names.reserve(field_count);
+		for (unsigned short index = 0; index < field_count; ++index)
+		{
+			names.push_back(fmt::format(L"long_value_{}", index));
+		}
+
+		start = logger::handle().chrono_start();
+		value_container data4;
+		for (unsigned short index = 0; index < field_count; ++index)
+		{
+			data4.add(make_shared<long_value>(names[index], index));
+		}
+		logger::handle().write(logging_level::information, fmt::format(L"added {} values", field_count), start);
+
+		start = logger::handle().chrono_start();
+		for (auto& name : names)
+		{
+			data4.get_value(name);
+		}
+		logger::handle().write(logging_level::information, fmt::format(L"found {} values by name", field_count), start);
+
+		start = logger::handle().chrono_start();
+		auto data5 = data4.copy();
+		data5->swap_header();
+		data5->remove(names.front());
+		data5->add(make_shared<long_value>(names.front(), LONG_MAX));
+		logger::handle().write(logging_level::information, fmt::format(L"copied {} values and modified one", field_count), start);
+
+		identical = verify_round_trip(data4) && identical;
+
+		start = logger::handle().chrono_start();
+		for (auto& name : names)
+		{
+			data4.remove(name);
+		}
+		logger::handle().write(logging_level::information, fmt::format(L"removed {} values by name", field_count), start);
+	}
+
 	logger::handle().stop();
 
-    return 0;
+    return identical ? 0 : 1;
+}
+
+bool verify_round_trip(value_container& source)
+{
+	// any faster serializer or parser must keep these outputs byte-identical
+	auto start = logger::handle().chrono_start();
+	wstring serialized = source.serialize();
+	logger::handle().write(logging_level::sequence, fmt::format(L"serialized {} characters", serialized.size()), start);
+
+	start = logger::handle().chrono_start();
+	value_container parsed(serialized, false);
+	logger::handle().write(logging_level::sequence, fmt::format(L"parsed {} characters", serialized.size()), start);
+
+	if (parsed.serialize() != serialized)
+	{
+		logger::handle().write(logging_level::error, fmt::format(L"serialize is not identical after parsing:\n{}", serialized));
+
+		return false;
+	}
+
+	if (parsed.to_xml() != source.to_xml())
+	{
+		logger::handle().write(logging_level::error, fmt::format(L"to_xml is not identical after parsing:\n{}", serialized));
+
+		return false;
+	}
+
+	if (parsed.to_json() != source.to_json())
+	{
+		logger::handle().write(logging_level::error, fmt::format(L"to_json is not identical after parsing:\n{}", serialized));
+
+		return false;
+	}
+
+	return true;
+}
+
+// the round trip above only shows that the library agrees with itself,
+// so the outputs are also compared with the files recorded from a trusted build in golden_folder
+bool verify_golden(value_container& source, const wstring& name)
+{
+	bool identical = verify_golden(source.serialize(), fmt::format(L"{}.serialize.txt", name));
+	identical = verify_golden(source.to_xml(), fmt::format(L"{}.xml", name)) && identical;
+	identical = verify_golden(source.to_json(), fmt::format(L"{}.json", name)) && identical;
+
+	return identical;
+}
+
+bool verify_golden(const wstring& output, const wstring& file_name)
+{
+	wstring path = fmt::format(L"{}/{}", golden_folder, file_name);
+
+	if (record_golden)
+	{
+		if (!file::save(path, converter::to_array(output)))
+		{
+			logger::handle().write(logging_level::error, fmt::format(L"cannot record golden file: {}", path));
+
+			return false;
+		}
+
+		logger::handle().write(logging_level::information, fmt::format(L"recorded golden file: {}", path));
+
+		return true;
+	}
+
+	auto golden = file::load(path);
+	if (golden.empty())
+	{
+		logger::handle().write(logging_level::error, fmt::format(L"cannot load golden file: {}", path));
+
+		return false;
+	}
+
+	if (converter::to_wstring(golden) != output)
+	{
+		logger::handle().write(logging_level::error, 
+			fmt::format(L"output is not identical to golden file {}:\n{}", path, output));
+
+		return false;
+	}
+
+	return true;
 }
 
 bool parse_arguments(argument_manager& arguments)
@@ -136,13 +279,31 @@ bool parse_arguments(argument_manager& arguments)
 		return false;
 	}
 
+	auto ushort_target = arguments.to_ushort(L"--field_count");
+	if (ushort_target != nullopt)
+	{
+		field_count = *ushort_target;
+	}
+
+	string_target = arguments.to_string(L"--golden_folder");
+	if (string_target != nullopt)
+	{
+		golden_folder = *string_target;
+	}
+
+	auto bool_target = arguments.to_bool(L"--record_golden");
+	if (bool_target != nullopt)
+	{
+		record_golden = *bool_target;
+	}
+
 	auto int_target = arguments.to_int(L"--logging_level");
 	if (int_target != nullopt)
 	{
 		log_level = (logging_level)*int_target;
 	}
 	
-	auto bool_target = arguments.to_bool(L"--write_console_only");
+	bool_target = arguments.to_bool(L"--write_console_only");
 	if (bool_target != nullopt && *bool_target)
 	{
 		logging_style = logging_styles::console_only;
@@ -166,6 +327,12 @@ bool parse_arguments(argument_manager& arguments)
 void display_help(void)
 {
 	wcout << L"container sample options:" << endl << endl;
+	wcout << L"--field_count [value]" << endl;
+	wcout << L"\tIf you want to measure adding, finding and removing many values by name must be appended '--field_count [count]'.\n\tInitialize value is --field_count 0." << endl << endl;
+	wcout << L"--golden_folder [value]" << endl;
+	wcout << L"\tIf you want to compare serialize, xml and json of the sample containers with recorded files must be appended\n\t'--golden_folder [folder path]'." << endl << endl;
+	wcout << L"--record_golden [value]" << endl;
+	wcout << L"\tIf you want to record the files of --golden_folder from a trusted build must be appended '--record_golden true'.\n\tInitialize value is --record_golden off." << endl << endl;
 	wcout << L"--write_console [value] " << endl;
 	wcout << L"\tThe write_console_mode on/off. If you want to display log on console must be appended '--write_console true'.\n\tInitialize value is --write_console off." << endl << endl;
 	wcout << L"--logging_level [value]" << endl;
@@ -35,6 +35,16 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <future>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define USE_COROUTINE
+#endif
 
 #include "job.h"
 #include "logging.h"
@@ -46,11 +56,22 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "container.h"
 #include "values/string_value.h"
+#include "values/ullong_value.h"
 #include "values/container_value.h"
 
 #include "fmt/xchar.h"
 #include "fmt/format.h"
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 constexpr auto PROGRAM_NAME = L"echo_client";
 
 using namespace std;
@@ -79,26 +100,309 @@ unsigned short server_port = 9876;
 unsigned short high_priority_count = 1;
 unsigned short normal_priority_count = 2;
 unsigned short low_priority_count = 3;
+unsigned short connection_count = 1;
+unsigned short shard_count = 1;
+unsigned short request_count = 1;
+unsigned short request_timeout = 10000;
+bool coroutine_mode = false;
+unsigned short request_interval = 0;
+wstring binary_file = L"";
+size_t chunk_size = 65536;
+unsigned short window_size = 8;
+unsigned short reconnect_count = 0;
+unsigned short reconnect_delay = 100;
 
 shared_ptr<thread_pool> _thread_pool = nullptr;
 
-map<wstring, function<void(const vector<uint8_t>&)>> _registered_messages;
+// handlers are registered before any connection and never change afterwards,
+// so a job can keep a pointer to its handler instead of copying the std::function
+unordered_map<wstring, function<void(shared_ptr<container::value_container>)>> _registered_messages;
 
+mutex _promise_mutex;
+size_t _remaining_replies = 0;
 optional<promise<bool>> _promise_status;
 future<bool> _future_status;
-shared_ptr<messaging_client> _client = nullptr;
+vector<unsigned short> _reconnect_attempts;
+mutex _clients_mutex;
+vector<shared_ptr<messaging_client>> _clients;
+
+struct pending_request
+{
+	function<void(shared_ptr<container::value_container>)> callback;
+	multimap<chrono::steady_clock::time_point, unsigned long long>::iterator deadline;
+	chrono::steady_clock::time_point sent;
+	bool timer;
+};
+
+mutex _request_mutex;
+condition_variable _request_condition;
+bool _request_checking = false;
+unsigned long long _last_request_id = 0;
+unordered_map<unsigned long long, pending_request> _pending_requests;
+multimap<chrono::steady_clock::time_point, unsigned long long> _request_deadlines;
+thread _request_thread;
+vector<chrono::microseconds> _request_latencies;
+
+// maps a whole file read-only, so chunks are copied from the page cache
+// without reading the file into a buffer first. data() is valid until close() or destruction.
+class mapped_file
+{
+public:
+	mapped_file(void) = default;
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	~mapped_file(void)
+	{
+		close();
+	}
+
+	bool open(const wstring& path)
+	{
+		close();
+
+#ifdef _WIN32
+		_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, 
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (_file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(_file, &file_size))
+		{
+			close();
+
+			return false;
+		}
+
+		_size = (size_t)file_size.QuadPart;
+		if (_size == 0)
+		{
+			return true;
+		}
+
+		_mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (_mapping == nullptr)
+		{
+			close();
+
+			return false;
+		}
+
+		_data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		_file = ::open(converter::to_string(path).c_str(), O_RDONLY);
+		if (_file < 0)
+		{
+			return false;
+		}
+
+		struct stat file_status;
+		if (fstat(_file, &file_status) != 0)
+		{
+			close();
+
+			return false;
+		}
+
+		_size = (size_t)file_status.st_size;
+		if (_size == 0)
+		{
+			return true;
+		}
+
+		void* mapped = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _file, 0);
+		if (mapped == MAP_FAILED)
+		{
+			close();
+
+			return false;
+		}
+
+		madvise(mapped, _size, MADV_SEQUENTIAL);
+		_data = (const uint8_t*)mapped;
+#endif
+		if (_data == nullptr)
+		{
+			close();
+
+			return false;
+		}
+
+		return true;
+	}
+
+	void close(void)
+	{
+#ifdef _WIN32
+		if (_data != nullptr)
+		{
+			UnmapViewOfFile(_data);
+		}
+		if (_mapping != nullptr)
+		{
+			CloseHandle(_mapping);
+			_mapping = nullptr;
+		}
+		if (_file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(_file);
+			_file = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (_data != nullptr)
+		{
+			munmap((void*)_data, _size);
+		}
+		if (_file >= 0)
+		{
+			::close(_file);
+			_file = -1;
+		}
+#endif
+		_data = nullptr;
+		_size = 0;
+	}
+
+	const uint8_t* data(void) const
+	{
+		return _data;
+	}
+
+	size_t size(void) const
+	{
+		return _size;
+	}
+
+private:
+	const uint8_t* _data = nullptr;
+	size_t _size = 0;
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+#else
+	int _file = -1;
+#endif
+};
+
+struct binary_stream
+{
+	mutex guard;
+	mapped_file source;
+	size_t offset = 0;
+	wstring target_id;
+	wstring target_sub_id;
+	size_t in_flight = 0;
+	bool completed = false;
+	// send_binary copies the chunk, so one buffer per stream is reused for every chunk it sends
+	vector<uint8_t> chunk;
+};
+
+vector<unique_ptr<binary_stream>> _binary_streams;
 
 bool parse_arguments(argument_manager& arguments);
 void display_help(void);
 
-void create_client(void);
+void register_message(const wstring& message_type, const function<void(shared_ptr<container::value_container>)>& handler);
+
+void create_clients(void);
+void create_client(const unsigned short& connection_index);
+shared_ptr<messaging_client> client_of(const unsigned short& connection_index);
 void create_thread_pool(void);
-void send_echo_test_message(const wstring& target_id, const wstring& target_sub_id);
-void connection(const wstring& target_id, const wstring& target_sub_id, const bool& condition);
-void received_message(shared_ptr<container::value_container> container);
-void received_binary_message(const wstring& source_id, const wstring& source_sub_id, 
+void schedule_reconnect(const unsigned short& connection_index);
+void reconnect(const unsigned short& connection_index);
+void complete_echo_test(const bool& result);
+void start_request_checker(void);
+void stop_request_checker(void);
+void check_request_deadlines(void);
+unsigned long long send_request(const unsigned short& connection_index, shared_ptr<container::value_container> request,
+	const function<void(shared_ptr<container::value_container>)>& callback);
+future<shared_ptr<container::value_container>> send_request(const unsigned short& connection_index, 
+	shared_ptr<container::value_container> request);
+bool complete_request(shared_ptr<container::value_container> response);
+void start_timer(const chrono::milliseconds& delay, const function<void(void)>& callback);
+void write_request_statistics(const chrono::steady_clock::duration& elapsed);
+void send_echo_test_message(const unsigned short& connection_index, const wstring& target_id, const wstring& target_sub_id);
+bool binary_streaming(void);
+bool start_binary_stream(const unsigned short& connection_index, const wstring& target_id, const wstring& target_sub_id);
+void send_binary_chunks(const unsigned short& connection_index, binary_stream& stream);
+void connection(const unsigned short& connection_index, const wstring& target_id, const wstring& target_sub_id, const bool& condition);
+void received_message(const unsigned short& connection_index, shared_ptr<container::value_container> container);
+void received_binary_message(const unsigned short& connection_index, const wstring& source_id, const wstring& source_sub_id, 
 	const wstring& target_id, const wstring& target_sub_id, const vector<uint8_t>& data);
-void received_echo_test(const vector<uint8_t>& data);
+void received_echo_test(shared_ptr<container::value_container> container);
+
+#ifdef USE_COROUTINE
+// fire-and-forget coroutine for a multi-step conversation.
+// It suspends on the awaiters below instead of blocking a thread_worker.
+struct conversation
+{
+	struct promise_type
+	{
+		conversation get_return_object(void) { return {}; }
+		suspend_never initial_suspend(void) noexcept { return {}; }
+		suspend_never final_suspend(void) noexcept { return {}; }
+		void return_void(void) {}
+		void unhandled_exception(void) { terminate(); }
+	};
+};
+
+// continues a suspended conversation on a worker of _thread_pool which handles the given priority,
+// so neither a network thread nor the request checker thread runs the conversation
+void resume_conversation(coroutine_handle<> handle, const priorities& priority)
+{
+	_thread_pool->push(make_shared<job>(priority, [handle]() { handle.resume(); }));
+}
+
+// resumes with the response of send_request, or nullptr after request_timeout or stop_request_checker()
+struct request_awaiter
+{
+	unsigned short connection_index;
+	shared_ptr<container::value_container> request;
+	shared_ptr<container::value_container> response = nullptr;
+
+	bool await_ready(void) { return false; }
+	void await_suspend(coroutine_handle<> handle)
+	{
+		send_request(connection_index, request, 
+			[this, handle](shared_ptr<container::value_container> message)
+			{
+				response = message;
+				resume_conversation(handle, priorities::normal);
+			});
+	}
+	shared_ptr<container::value_container> await_resume(void) { return response; }
+};
+
+// resumes on a worker of _thread_pool which handles the given priority
+struct schedule_awaiter
+{
+	priorities priority;
+
+	bool await_ready(void) { return false; }
+	void await_suspend(coroutine_handle<> handle)
+	{
+		resume_conversation(handle, priority);
+	}
+	void await_resume(void) {}
+};
+
+// resumes on a worker of _thread_pool after the delay, or at once after stop_request_checker()
+struct timer_awaiter
+{
+	chrono::milliseconds delay;
+
+	bool await_ready(void) { return delay.count() <= 0; }
+	void await_suspend(coroutine_handle<> handle)
+	{
+		start_timer(delay, [handle]() { resume_conversation(handle, priorities::normal); });
+	}
+	void await_resume(void) {}
+};
+
+conversation echo_conversation(const unsigned short connection_index, const wstring target_id, const wstring target_sub_id);
+#endif
 
 int main(int argc, char* argv[])
 {
@@ -116,23 +420,43 @@ int main(int argc, char* argv[])
 	logger::handle().start(PROGRAM_NAME);
 #endif
 
-	_registered_messages.insert({ L"echo_test", received_echo_test });
+	register_message(L"echo_test", received_echo_test);
+
+	_remaining_replies = (size_t)connection_count * (binary_streaming() ? 1 : request_count);
+	_promise_status = { promise<bool>() };
+	_future_status = _promise_status.value().get_future();
+
+	start_request_checker();
 
 	create_thread_pool();
 
-	create_client();
+	auto started = chrono::steady_clock::now();
 
-	_promise_status = { promise<bool>() };
-	_future_status = _promise_status.value().get_future();
+	create_clients();
 
 	_future_status.wait();
-	_promise_status.reset();
+
+	stop_request_checker();
+
+	write_request_statistics(chrono::steady_clock::now() - started);
 
 	_thread_pool->stop();
 	_thread_pool.reset();
 
-	_client->stop();
-	_client.reset();
+	vector<shared_ptr<messaging_client>> clients;
+	{
+		scoped_lock<mutex> guard(_clients_mutex);
+
+		clients.swap(_clients);
+	}
+
+	for (auto& client : clients)
+	{
+		if (client != nullptr)
+		{
+			client->stop();
+		}
+	}
 
 	logger::handle().stop();
 
@@ -175,6 +499,12 @@ bool parse_arguments(argument_manager& arguments)
 		compress_block_size = *ushort_target;
 	}
 
+	string_target = arguments.to_string(L"--server_ip");
+	if (string_target != nullopt && !string_target->empty())
+	{
+		server_ip = *string_target;
+	}
+
 	string_target = arguments.to_string(L"--connection_key");
 	if (string_target != nullopt)
 	{
@@ -208,6 +538,80 @@ bool parse_arguments(argument_manager& arguments)
 	{
 		low_priority_count = *ushort_target;
 	}
+
+	ushort_target = arguments.to_ushort(L"--connection_count");
+	if (ushort_target != nullopt && *ushort_target > 0)
+	{
+		connection_count = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--shard_count");
+	if (ushort_target != nullopt && *ushort_target > 0)
+	{
+		shard_count = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--request_count");
+	if (ushort_target != nullopt && *ushort_target > 0)
+	{
+		request_count = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--request_timeout");
+	if (ushort_target != nullopt)
+	{
+		request_timeout = *ushort_target;
+	}
+
+	string_target = arguments.to_string(L"--binary_file");
+	if (string_target != nullopt)
+	{
+		binary_file = *string_target;
+	}
+
+#ifdef _WIN32
+	auto ullong_target = arguments.to_ullong(L"--chunk_size");
+	if (ullong_target != nullopt && *ullong_target > 0)
+	{
+		chunk_size = *ullong_target;
+	}
+#else
+	auto ulong_target = arguments.to_ulong(L"--chunk_size");
+	if (ulong_target != nullopt && *ulong_target > 0)
+	{
+		chunk_size = *ulong_target;
+	}
+#endif
+
+	ushort_target = arguments.to_ushort(L"--window_size");
+	if (ushort_target != nullopt && *ushort_target > 0)
+	{
+		window_size = *ushort_target;
+	}
+
+	bool_target = arguments.to_bool(L"--coroutine_mode");
+	if (bool_target != nullopt)
+	{
+		coroutine_mode = *bool_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--request_interval");
+	if (ushort_target != nullopt)
+	{
+		request_interval = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--reconnect_count");
+	if (ushort_target != nullopt)
+	{
+		reconnect_count = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--reconnect_delay");
+	if (ushort_target != nullopt)
+	{
+		reconnect_delay = *ushort_target;
+	}
 	
 	auto int_target = arguments.to_int(L"--logging_level");
 	if (int_target != nullopt)
@@ -239,36 +643,128 @@ bool parse_arguments(argument_manager& arguments)
 void display_help(void)
 {
 	wcout << L"pathfinder connector options:" << endl << endl;
+	wcout << L"--server_ip [value]" << endl;
+	wcout << L"\tIf you want to change an ip address for the connection to the main server must be appended\n\t'--server_ip [ip address]'.\n\tInitialize value is --server_ip 127.0.0.1." << endl << endl;
+	wcout << L"--connection_count [value]" << endl;
+	wcout << L"\tIf you want to share the thread pool with several connections to the main server must be appended\n\t'--connection_count [count]'.\n\tEach connection still starts at least 3 network threads.\n\tInitialize value is --connection_count 1." << endl << endl;
+	wcout << L"--shard_count [value]" << endl;
+	wcout << L"\tIf the echo_server runs several shards must be appended '--shard_count [count]'.\n\tThe connections are spread over the port number plus the shard index.\n\tInitialize value is --shard_count 1." << endl << endl;
+	wcout << L"--request_count [value]" << endl;
+	wcout << L"\tIf you want to pipeline several echo requests on each connection must be appended '--request_count [count]'.\n\tInitialize value is --request_count 1." << endl << endl;
+	wcout << L"--request_timeout [value]" << endl;
+	wcout << L"\tIf you want to change the deadline(ms) of each echo request must be appended '--request_timeout [milliseconds]'.\n\tInitialize value is --request_timeout 10000." << endl << endl;
+	wcout << L"--coroutine_mode [value]" << endl;
+	wcout << L"\tThe coroutine_mode on/off. If you want to send the echo requests of a connection one by one from a coroutine\n\tmust be appended '--coroutine_mode true'. It needs a C++20 build.\n\tInitialize value is --coroutine_mode off." << endl << endl;
+	wcout << L"--request_interval [value]" << endl;
+	wcout << L"\tIf you want to wait between the echo requests of the coroutine_mode must be appended '--request_interval [milliseconds]'.\n\tInitialize value is --request_interval 0." << endl << endl;
+	wcout << L"--binary_file [value]" << endl;
+	wcout << L"\tIf you want to stream a file as echo chunks in binary mode must be appended '--binary_file [file path]'." << endl << endl;
+	wcout << L"--chunk_size [value]" << endl;
+	wcout << L"\tIf you want to change the size of each binary chunk must be appended '--chunk_size [bytes]'.\n\tInitialize value is --chunk_size 65536." << endl << endl;
+	wcout << L"--window_size [value]" << endl;
+	wcout << L"\tIf you want to change the number of binary chunks waiting for their echo must be appended '--window_size [count]'.\n\tInitialize value is --window_size 8." << endl << endl;
+	wcout << L"--reconnect_count [value]" << endl;
+	wcout << L"\tIf you want to reconnect after a disconnection must be appended '--reconnect_count [count]'.\n\tInitialize value is --reconnect_count 0." << endl << endl;
+	wcout << L"--reconnect_delay [value]" << endl;
+	wcout << L"\tIf you want to change the base delay(ms) of the reconnection backoff must be appended '--reconnect_delay [milliseconds]'.\n\tInitialize value is --reconnect_delay 100." << endl << endl;
 	wcout << L"--write_console [value] " << endl;
 	wcout << L"\tThe write_console_mode on/off. If you want to display log on console must be appended '--write_console true'.\n\tInitialize value is --write_console off." << endl << endl;
 	wcout << L"--logging_level [value]" << endl;
 	wcout << L"\tIf you want to change log level must be appended '--logging_level [level]'." << endl;
 }
 
-void create_client(void)
+void register_message(const wstring& message_type, const function<void(shared_ptr<container::value_container>)>& handler)
+{
+	_registered_messages[message_type] = handler;
+}
+
+void create_clients(void)
 {
-	if (_client != nullptr)
 	{
-		_client.reset();
+		scoped_lock<mutex> guard(_clients_mutex);
+
+		_clients.clear();
+		_clients.resize(connection_count, nullptr);
+	}
+	_binary_streams.clear();
+	for (unsigned short connection_index = 0; connection_index < connection_count; ++connection_index)
+	{
+		_binary_streams.push_back(make_unique<binary_stream>());
 	}
+	{
+		scoped_lock<mutex> guard(_clients_mutex);
+
+		_reconnect_attempts.assign(connection_count, 0);
+	}
+
+	for (unsigned short connection_index = 0; connection_index < connection_count; ++connection_index)
+	{
+		create_client(connection_index);
+	}
+}
 
-	_client = make_shared<messaging_client>(PROGRAM_NAME);
-	_client->set_encrypt_mode(encrypt_mode);
-	_client->set_compress_mode(compress_mode);
-	_client->set_compress_block_size(compress_block_size);
-	_client->set_connection_key(connection_key);
-	_client->set_connection_notification(&connection);
+void create_client(const unsigned short& connection_index)
+{
+	// every connection shares _thread_pool for its handlers and the priority counts are divided among the connections,
+	// but each messaging_client still starts at least one network thread per priority.
+	// So the network threads grow linearly with connection_count until messaging_system can share one event loop.
+	auto divide = [](const unsigned short& count) -> unsigned short
+	{
+		return max<unsigned short>(1, count / connection_count);
+	};
+
+	auto client = make_shared<messaging_client>(PROGRAM_NAME);
+	client->set_encrypt_mode(encrypt_mode);
+	client->set_compress_mode(compress_mode);
+	client->set_compress_block_size(compress_block_size);
+	client->set_connection_key(connection_key);
+	client->set_connection_notification(
+		[connection_index](const wstring& target_id, const wstring& target_sub_id, const bool& condition)
+		{
+			connection(connection_index, target_id, target_sub_id, condition);
+		});
 	if (binary_mode)
 	{
-		_client->set_binary_notification(&received_binary_message);
-		_client->set_session_types({ session_types::binary_line });
+		client->set_binary_notification(
+			[connection_index](const wstring& source_id, const wstring& source_sub_id, 
+				const wstring& target_id, const wstring& target_sub_id, const vector<uint8_t>& data)
+			{
+				received_binary_message(connection_index, source_id, source_sub_id, target_id, target_sub_id, data);
+			});
+		client->set_session_types({ session_types::binary_line });
 	}
 	else
 	{
-		_client->set_message_notification(&received_message);
-		_client->set_session_types({ session_types::message_line });
+		client->set_message_notification(
+			[connection_index](shared_ptr<container::value_container> container)
+			{
+				received_message(connection_index, container);
+			});
+		client->set_session_types({ session_types::message_line });
+	}
+
+	// the previous client of a reconnection is replaced under the lock,
+	// because the notification threads of the other connections read _clients at the same time
+	{
+		scoped_lock<mutex> guard(_clients_mutex);
+
+		_clients[connection_index] = client;
+	}
+
+	client->start(server_ip, server_port + connection_index % shard_count, 
+		divide(high_priority_count), divide(normal_priority_count), divide(low_priority_count));
+}
+
+shared_ptr<messaging_client> client_of(const unsigned short& connection_index)
+{
+	scoped_lock<mutex> guard(_clients_mutex);
+
+	if (connection_index >= _clients.size())
+	{
+		return nullptr;
 	}
-	_client->start(server_ip, server_port, high_priority_count, normal_priority_count, low_priority_count);
+
+	return _clients[connection_index];
 }
 
 void create_thread_pool(void)
@@ -294,22 +790,440 @@ void create_thread_pool(void)
 	_thread_pool->start();
 }
 
-void send_echo_test_message(const wstring& target_id, const wstring& target_sub_id)
+void schedule_reconnect(const unsigned short& connection_index)
 {
-	if (binary_mode)
+	// full jitter backoff spreads the reconnection of many clients after a server restart
+	// so that the server does not have to handle every handshake at the same moment.
+	// The backoff waits on the request checker timer, so no thread_worker sleeps through it.
+	static mt19937 engine{ random_device{}() };
+
+	unsigned int delay = 0;
+	{
+		scoped_lock<mutex> guard(_clients_mutex);
+
+		auto& reconnect_attempt = _reconnect_attempts[connection_index];
+		uniform_int_distribution<unsigned int> distribution(0, 
+			(unsigned int)reconnect_delay << min<unsigned short>(reconnect_attempt, 10));
+
+		++reconnect_attempt;
+		delay = distribution(engine);
+	}
+
+	start_timer(chrono::milliseconds(delay), 
+		[connection_index]()
+		{
+			if (_thread_pool)
+			{
+				_thread_pool->push(make_shared<job>(priorities::low, [connection_index]() { reconnect(connection_index); }));
+			}
+		});
+}
+
+void reconnect(const unsigned short& connection_index)
+{
+	{
+		scoped_lock<mutex> guard(_promise_mutex);
+
+		// the echo test is over and main is stopping the clients
+		if (!_promise_status.has_value())
+		{
+			return;
+		}
+	}
+
+	unsigned short reconnect_attempt = 0;
+	{
+		scoped_lock<mutex> guard(_clients_mutex);
+
+		reconnect_attempt = _reconnect_attempts[connection_index];
+	}
+
+	logger::handle().write(logging_level::information,
+		fmt::format(L"try to reconnect to an echo_server[{}]: {}/{}", connection_index, reconnect_attempt, reconnect_count));
+
+	create_client(connection_index);
+}
+
+void complete_echo_test(const bool& result)
+{
+	scoped_lock<mutex> guard(_promise_mutex);
+
+	if (!_promise_status.has_value())
+	{
+		return;
+	}
+
+	if (result && --_remaining_replies > 0)
+	{
+		return;
+	}
+
+	_promise_status.value().set_value(result);
+	_promise_status.reset();
+}
+
+void start_request_checker(void)
+{
+	stop_request_checker();
+
+	_request_checking = true;
+	_request_thread = thread(&check_request_deadlines);
+}
+
+void stop_request_checker(void)
+{
+	if (!_request_thread.joinable())
+	{
+		return;
+	}
+
+	{
+		scoped_lock<mutex> guard(_request_mutex);
+		_request_checking = false;
+	}
+	_request_condition.notify_one();
+
+	_request_thread.join();
+
+	// expire whatever is still pending, so suspended conversations resume with nullptr and free their frames
+	unordered_map<unsigned long long, pending_request> pending;
+	{
+		scoped_lock<mutex> guard(_request_mutex);
+
+		pending.swap(_pending_requests);
+		_request_deadlines.clear();
+	}
+
+	for (auto& target : pending)
+	{
+		if (target.second.callback != nullptr)
+		{
+			target.second.callback(nullptr);
+		}
+	}
+}
+
+void check_request_deadlines(void)
+{
+	unique_lock<mutex> lock(_request_mutex);
+	while (_request_checking)
+	{
+		if (_request_deadlines.empty())
+		{
+			_request_condition.wait(lock);
+
+			continue;
+		}
+
+		auto deadline = _request_deadlines.begin();
+		if (deadline->first > chrono::steady_clock::now())
+		{
+			_request_condition.wait_until(lock, deadline->first);
+
+			continue;
+		}
+
+		unsigned long long request_id = deadline->second;
+		auto target = _pending_requests.find(request_id);
+		auto callback = move(target->second.callback);
+		bool timer = target->second.timer;
+		_pending_requests.erase(target);
+		_request_deadlines.erase(deadline);
+
+		lock.unlock();
+
+		if (!timer)
+		{
+			logger::handle().write(logging_level::error,
+				fmt::format(L"request({}) is expired after {} ms", request_id, request_timeout));
+		}
+
+		if (callback != nullptr)
+		{
+			callback(nullptr);
+		}
+
+		lock.lock();
+	}
+}
+
+unsigned long long send_request(const unsigned short& connection_index, shared_ptr<container::value_container> request,
+	const function<void(shared_ptr<container::value_container>)>& callback)
+{
+	auto client = client_of(connection_index);
+	if (client == nullptr || request == nullptr)
+	{
+		if (callback != nullptr)
+		{
+			callback(nullptr);
+		}
+
+		return 0;
+	}
+
+	unsigned long long request_id = 0;
+	{
+		scoped_lock<mutex> guard(_request_mutex);
+
+		if (_request_checking)
+		{
+			request_id = ++_last_request_id;
+			auto deadline = _request_deadlines.insert(
+				{ chrono::steady_clock::now() + chrono::milliseconds(request_timeout), request_id });
+			_pending_requests.insert({ request_id, { callback, deadline, chrono::steady_clock::now(), false } });
+		}
+	}
+
+	// nothing would expire the request after stop_request_checker()
+	if (request_id == 0)
 	{
-		_client->send_binary(target_id, target_sub_id, converter::to_array(L"echo_test"));
+		if (callback != nullptr)
+		{
+			callback(nullptr);
+		}
+
+		return 0;
+	}
+	_request_condition.notify_one();
+
+	// the echo_server returns every value of a request, so the reply carries the same request_id
+	request->add(ullong_value(L"request_id", request_id));
+	client->send(request);
+
+	return request_id;
+}
+
+future<shared_ptr<container::value_container>> send_request(const unsigned short& connection_index, 
+	shared_ptr<container::value_container> request)
+{
+	auto response = make_shared<promise<shared_ptr<container::value_container>>>();
+	auto result = response->get_future();
+
+	send_request(connection_index, request, 
+		[response](shared_ptr<container::value_container> message)
+		{
+			response->set_value(message);
+		});
+
+	return result;
+}
+
+bool complete_request(shared_ptr<container::value_container> response)
+{
+	auto request_id = response->value_array(L"request_id");
+	if (request_id.empty())
+	{
+		return false;
+	}
+
+	function<void(shared_ptr<container::value_container>)> callback;
+	{
+		scoped_lock<mutex> guard(_request_mutex);
+
+		auto target = _pending_requests.find(request_id[0]->to_ullong());
+		if (target == _pending_requests.end())
+		{
+			return false;
+		}
 
+		callback = move(target->second.callback);
+		_request_latencies.push_back(
+			chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - target->second.sent));
+		_request_deadlines.erase(target->second.deadline);
+		_pending_requests.erase(target);
+	}
+
+	if (callback != nullptr)
+	{
+		callback(response);
+	}
+
+	return true;
+}
+
+void start_timer(const chrono::milliseconds& delay, const function<void(void)>& callback)
+{
+	bool checking;
+	{
+		scoped_lock<mutex> guard(_request_mutex);
+
+		checking = _request_checking;
+		if (checking)
+		{
+			unsigned long long timer_id = ++_last_request_id;
+			auto deadline = _request_deadlines.insert({ chrono::steady_clock::now() + delay, timer_id });
+			_pending_requests.insert({ timer_id, 
+				{ [callback](shared_ptr<container::value_container>) { callback(); }, deadline, chrono::steady_clock::now(), true } });
+		}
+	}
+
+	// after stop_request_checker() a timer fires at once like the pending ones did
+	if (!checking)
+	{
+		if (callback != nullptr)
+		{
+			callback();
+		}
+
+		return;
+	}
+	_request_condition.notify_one();
+}
+
+void write_request_statistics(const chrono::steady_clock::duration& elapsed)
+{
+	scoped_lock<mutex> guard(_request_mutex);
+
+	if (_request_latencies.empty())
+	{
 		return;
 	}
 
-	shared_ptr<container::value_container> container =
-		make_shared<container::value_container>(target_id, target_sub_id, L"echo_test", vector<shared_ptr<value>>{});
+	sort(_request_latencies.begin(), _request_latencies.end());
+
+	auto percentile = [](const double& rate) -> long long
+	{
+		return _request_latencies[(size_t)((_request_latencies.size() - 1) * rate)].count();
+	};
 
-	_client->send(container);
+	double seconds = chrono::duration<double>(elapsed).count();
+	logger::handle().write(logging_level::information,
+		fmt::format(L"{} requests to {}:{} in {:.3f} s ({:.1f} requests/s), latency(us) p50: {}, p99: {}, max: {}",
+			_request_latencies.size(), server_ip, server_port, seconds, 
+			seconds > 0 ? _request_latencies.size() / seconds : 0.0,
+			percentile(0.5), percentile(0.99), _request_latencies.back().count()));
 }
 
-void connection(const wstring& target_id, const wstring& target_sub_id, const bool& condition)
+void send_echo_test_message(const unsigned short& connection_index, const wstring& target_id, const wstring& target_sub_id)
+{
+	auto client = client_of(connection_index);
+	if (client == nullptr)
+	{
+		return;
+	}
+
+	if (binary_streaming())
+	{
+		if (!start_binary_stream(connection_index, target_id, target_sub_id))
+		{
+			complete_echo_test(false);
+		}
+
+		return;
+	}
+
+#ifdef USE_COROUTINE
+	if (coroutine_mode && !binary_mode)
+	{
+		echo_conversation(connection_index, target_id, target_sub_id);
+
+		return;
+	}
+#endif
+
+	for (unsigned short request_index = 0; request_index < request_count; ++request_index)
+	{
+		if (binary_mode)
+		{
+			client->send_binary(target_id, target_sub_id, converter::to_array(L"echo_test"));
+
+			continue;
+		}
+
+		shared_ptr<container::value_container> container =
+			make_shared<container::value_container>(target_id, target_sub_id, L"echo_test", vector<shared_ptr<value>>{});
+
+		send_request(connection_index, container, 
+			[](shared_ptr<container::value_container> response)
+			{
+				complete_echo_test(response != nullptr);
+			});
+	}
+}
+
+#ifdef USE_COROUTINE
+conversation echo_conversation(const unsigned short connection_index, const wstring target_id, const wstring target_sub_id)
+{
+	// leave the network thread which notified the connection
+	co_await schedule_awaiter{ priorities::normal };
+
+	for (unsigned short request_index = 0; request_index < request_count; ++request_index)
+	{
+		if (request_index > 0)
+		{
+			co_await timer_awaiter{ chrono::milliseconds(request_interval) };
+		}
+
+		auto response = co_await request_awaiter{ connection_index, 
+			make_shared<container::value_container>(target_id, target_sub_id, L"echo_test", vector<shared_ptr<value>>{}) };
+
+		complete_echo_test(response != nullptr);
+		if (response == nullptr)
+		{
+			co_return;
+		}
+	}
+}
+#endif
+
+// a binary_file is only streamed in binary_mode, otherwise the echo requests are sent as usual
+bool binary_streaming(void)
+{
+	return binary_mode && !binary_file.empty();
+}
+
+bool start_binary_stream(const unsigned short& connection_index, const wstring& target_id, const wstring& target_sub_id)
+{
+	auto& stream = *_binary_streams[connection_index];
+
+	scoped_lock<mutex> guard(stream.guard);
+
+	if (!stream.source.open(binary_file))
+	{
+		logger::handle().write(logging_level::error, fmt::format(L"cannot open binary file: {}", binary_file));
+
+		return false;
+	}
+
+	stream.target_id = target_id;
+	stream.target_sub_id = target_sub_id;
+	stream.offset = 0;
+	stream.in_flight = 0;
+	stream.completed = false;
+
+	send_binary_chunks(connection_index, stream);
+	if (stream.in_flight == 0)
+	{
+		stream.completed = true;
+		complete_echo_test(true);
+	}
+
+	return true;
+}
+
+void send_binary_chunks(const unsigned short& connection_index, binary_stream& stream)
+{
+	// only window_size chunks wait for their echo at once,
+	// so the memory of a transfer is bounded by the window instead of the file size
+	auto client = client_of(connection_index);
+	if (client == nullptr)
+	{
+		return;
+	}
+
+	stream.chunk.reserve(chunk_size);
+	while (stream.in_flight < window_size && stream.offset < stream.source.size())
+	{
+		size_t read_size = min(chunk_size, stream.source.size() - stream.offset);
+		stream.chunk.assign(stream.source.data() + stream.offset, stream.source.data() + stream.offset + read_size);
+		client->send_binary(stream.target_id, stream.target_sub_id, stream.chunk);
+
+		++stream.in_flight;
+		stream.offset += read_size;
+	}
+}
+
+void connection(const unsigned short& connection_index, const wstring& target_id, const wstring& target_sub_id, const bool& condition)
 {
 	logger::handle().write(logging_level::information,
 		fmt::format(L"an echo_client({}[{}]) is {} an echo_server", target_id, target_sub_id,
@@ -317,31 +1231,65 @@ void connection(const wstring& target_id, const wstring& target_sub_id, const bo
 
 	if (condition)
 	{
-		send_echo_test_message(target_id, target_sub_id);
+		{
+			scoped_lock<mutex> guard(_clients_mutex);
+
+			_reconnect_attempts[connection_index] = 0;
+		}
+
+		send_echo_test_message(connection_index, target_id, target_sub_id);
 
 		return;
 	}
 
-	if (_promise_status.has_value())
+	bool retry = false;
 	{
-		_promise_status.value().set_value(false);
+		scoped_lock<mutex> guard(_clients_mutex);
+
+		retry = _reconnect_attempts[connection_index] < reconnect_count;
+	}
+
+	if (retry && _thread_pool)
+	{
+		schedule_reconnect(connection_index);
+
+		return;
 	}
+
+	complete_echo_test(false);
 }
 
-void received_message(shared_ptr<container::value_container> container)
+void received_message(const unsigned short& connection_index, shared_ptr<container::value_container> container)
 {
 	if (container == nullptr)
 	{
 		return;
 	}
 
+	// a heartbeat is answered on the connection it came from, so echo_server does not expire an idle connection
+	if (container->message_type() == L"heartbeat")
+	{
+		auto client = client_of(connection_index);
+		if (client != nullptr)
+		{
+			container->swap_header();
+			client->send(container);
+		}
+
+		return;
+	}
+
 	auto message_type = _registered_messages.find(container->message_type());
 	if (message_type != _registered_messages.end())
 	{
 		if (_thread_pool)
 		{
+			auto callback = &message_type->second;
 			_thread_pool->push(make_shared<job>(priorities::high, 
-				converter::to_array(container->serialize()), message_type->second));
+				[callback, container]()
+				{
+					(*callback)(container);
+				}));
 		}
 
 		return;
@@ -350,53 +1298,62 @@ void received_message(shared_ptr<container::value_container> container)
 	logger::handle().write(logging_level::sequence,
 		fmt::format(L"unknown message: {}", container->serialize()));
 
-	if (_promise_status.has_value())
-	{
-		_promise_status.value().set_value(false);
-	}
+	complete_echo_test(false);
 }
 
-void received_binary_message(const wstring& source_id, const wstring& source_sub_id, 
+void received_binary_message(const unsigned short& connection_index, const wstring& source_id, const wstring& source_sub_id, 
 	const wstring& target_id, const wstring& target_sub_id, const vector<uint8_t>& data)
 {
 	if (data.empty())
 	{
-		if (_promise_status.has_value())
-		{
-			_promise_status.value().set_value(false);
-		}
+		complete_echo_test(false);
 
 		return;
 	}
 
-	logger::handle().write(logging_level::sequence,
-		fmt::format(L"received message: {}", converter::to_wstring(data)));
-
-	if (_promise_status.has_value())
+	if (binary_file.empty())
 	{
-		_promise_status.value().set_value(true);
+		logger::handle().write(logging_level::sequence,
+			fmt::format(L"received message: {}", converter::to_wstring(data)));
+
+		complete_echo_test(true);
+
+		return;
 	}
-}
 
-void received_echo_test(const vector<uint8_t>& data)
-{
-	if (data.empty())
+	auto& stream = *_binary_streams[connection_index];
+
 	{
-		if (_promise_status.has_value())
+		scoped_lock<mutex> guard(stream.guard);
+
+		if (stream.completed || stream.in_flight == 0)
 		{
-			_promise_status.value().set_value(false);
+			return;
 		}
 
-		return;
+		--stream.in_flight;
+		send_binary_chunks(connection_index, stream);
+
+		if (stream.in_flight > 0 || stream.offset < stream.source.size())
+		{
+			return;
+		}
+
+		stream.completed = true;
+		stream.source.close();
 	}
 
-	shared_ptr<container::value_container> container = make_shared<container::value_container>(data, false);
+	logger::handle().write(logging_level::information,
+		fmt::format(L"echo_server[{}] returned {} bytes of {}", connection_index, stream.offset, binary_file));
+
+	complete_echo_test(true);
+}
+
+void received_echo_test(shared_ptr<container::value_container> container)
+{
 	if (container == nullptr)
 	{
-		if (_promise_status.has_value())
-		{
-			_promise_status.value().set_value(false);
-		}
+		complete_echo_test(false);
 
 		return;
 	}
@@ -404,8 +1361,9 @@ void received_echo_test(const vector<uint8_t>& data)
 	logger::handle().write(logging_level::sequence,
 		fmt::format(L"received message: {}", container->message_type()));
 
-	if (_promise_status.has_value())
+	if (!complete_request(container))
 	{
-		_promise_status.value().set_value(true);
+		logger::handle().write(logging_level::sequence,
+			fmt::format(L"there is no pending request for: {}", container->message_type()));
 	}
 }
\ No newline at end of file
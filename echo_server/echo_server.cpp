@@ -34,6 +34,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 #include <stdlib.h>
 #include <memory>
+#include <list>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <thread>
+#include <fstream>
+#include <optional>
+#include <shared_mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
 
 #include "job.h"
 #include "logging.h"
@@ -52,6 +63,18 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "fmt/format.h"
 
 #include <signal.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#endif
 
 constexpr auto PROGRAM_NAME = L"echo_server";
 
@@ -79,25 +102,690 @@ unsigned short server_port = 9876;
 unsigned short high_priority_count = 4;
 unsigned short normal_priority_count = 4;
 unsigned short low_priority_count = 4;
+unsigned short shard_count = 1;
 size_t session_limit_count = 0;
+size_t session_outbound_limit = 0;
+size_t global_outbound_limit = 0;
+bool backpressure_drop = false;
+unsigned short drain_timeout = 5000;
+unsigned short heartbeat_interval = 0;
+unsigned short idle_timeout = 30;
+wstring capture_file = L"";
+unsigned short metrics_port = 0;
+bool metrics_loopback_only = true;
+unsigned short log_rate_limit = 0;
+unsigned short log_sampling = 1;
+int _signal_pipe[2] = { -1, -1 };
+
+class outbound_limiter
+{
+public:
+	bool enabled(void) const
+	{
+		return session_outbound_limit > 0 || global_outbound_limit > 0;
+	}
+
+	// reserves the bytes of a message for its session while its echo job waits in the thread pool,
+	// and they are released as soon as the reply is handed to messaging_server.
+	// So only the echo job queue of this sample is bounded, not the bytes messaging_server keeps for a slow peer.
+	// A session without any reserved bytes is always admitted, so a single large message can not block forever.
+	// Blocking parks the messaging_server thread which received the message,
+	// so every session served by that thread waits as well, not only the session over its limit.
+	bool reserve(const wstring& session_key, const size_t& size)
+	{
+		unique_lock<mutex> lock(_mutex);
+
+		auto admitted = [&]() -> bool
+		{
+			auto target = _sessions.find(session_key);
+			size_t session_size = (target != _sessions.end()) ? target->second : 0;
+			if (session_outbound_limit > 0 && session_size > 0 && session_size + size > session_outbound_limit)
+			{
+				return false;
+			}
+
+			if (global_outbound_limit > 0 && _total > 0 && _total + size > global_outbound_limit)
+			{
+				return false;
+			}
+
+			return true;
+		};
+
+		if (!admitted())
+		{
+			if (backpressure_drop)
+			{
+				++_dropped;
+
+				return false;
+			}
+
+			++_blocked;
+			_condition.wait(lock, admitted);
+		}
+
+		_sessions[session_key] += size;
+		_total += size;
+		_peak = max(_peak, _total);
+
+		return true;
+	}
+
+	void release(const wstring& session_key, const size_t& size)
+	{
+		{
+			scoped_lock<mutex> guard(_mutex);
+
+			auto target = _sessions.find(session_key);
+			if (target != _sessions.end())
+			{
+				target->second -= min(target->second, size);
+				if (target->second == 0)
+				{
+					_sessions.erase(target);
+				}
+			}
+			_total -= min(_total, size);
+		}
+
+		_condition.notify_all();
+	}
+
+	wstring status(void)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		return fmt::format(L"outbound bytes: {} (peak {}), sessions: {}, blocked: {}, dropped: {}", 
+			_total, _peak, _sessions.size(), _blocked, _dropped);
+	}
+
+	wstring metrics(void)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		return fmt::format(
+			L"# TYPE echo_server_outbound_bytes gauge\necho_server_outbound_bytes {}\n"
+			L"# TYPE echo_server_outbound_peak_bytes gauge\necho_server_outbound_peak_bytes {}\n"
+			L"# TYPE echo_server_blocked_messages_total counter\necho_server_blocked_messages_total {}\n"
+			L"# TYPE echo_server_dropped_messages_total counter\necho_server_dropped_messages_total {}\n",
+			_total, _peak, _blocked, _dropped);
+	}
+
+private:
+	mutex _mutex;
+	condition_variable _condition;
+	unordered_map<wstring, size_t> _sessions;
+	size_t _total = 0;
+	size_t _peak = 0;
+	size_t _blocked = 0;
+	size_t _dropped = 0;
+};
+
+outbound_limiter _outbound_limiter;
+
+// the received messages are rejected once _draining is set, and the drain waits on
+// _drain_condition only until the echo jobs already queued are done
+atomic<bool> _draining{ false };
+atomic<size_t> _pending_jobs{ 0 };
+mutex _drain_mutex;
+condition_variable _drain_condition;
+
+// the logging level which can be changed with SIGUSR1 and SIGUSR2 while running
+atomic<int> _log_level{ (int)logging_level::information };
+
+class log_site
+{
+public:
+	log_site(const logging_level& level) : _level(level)
+	{
+	}
+
+	// a disabled site costs a relaxed load of the logging level, and an enabled one writes
+	// one of every log_sampling lines and at most log_rate_limit lines per second
+	bool enabled(void)
+	{
+		if (_log_level.load(memory_order_relaxed) < (int)_level)
+		{
+			return false;
+		}
+
+		if (log_sampling > 1 && _sampled.fetch_add(1, memory_order_relaxed) % log_sampling != 0)
+		{
+			return false;
+		}
+
+		if (log_rate_limit == 0)
+		{
+			return true;
+		}
+
+		long long second = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		long long window = _window.load(memory_order_relaxed);
+		if (window != second && _window.compare_exchange_strong(window, second, memory_order_relaxed))
+		{
+			_count.store(0, memory_order_relaxed);
+		}
+
+		return _count.fetch_add(1, memory_order_relaxed) < log_rate_limit;
+	}
+
+	logging_level level(void) const
+	{
+		return _level;
+	}
+
+private:
+	logging_level _level;
+	atomic<unsigned long long> _sampled{ 0 };
+	atomic<long long> _window{ 0 };
+	atomic<unsigned int> _count{ 0 };
+};
+
+log_site _received_message_log(logging_level::information);
+log_site _received_binary_log(logging_level::information);
+log_site _received_echo_log(logging_level::information);
+
+// a counter is split into slots of their own cache line and every thread adds to the slot it was given,
+// so the receiving threads do not bounce one cache line between cores. A scrape adds the slots up,
+// and threads beyond slot_count share slots with relaxed atomics.
+class metric_counter
+{
+public:
+	void add(const uint64_t& count = 1) { _slots[slot_index()].value.fetch_add(count, memory_order_relaxed); }
+
+	uint64_t load(void) const
+	{
+		uint64_t result = 0;
+		for (auto& slot : _slots)
+		{
+			result += slot.value.load(memory_order_relaxed);
+		}
+
+		return result;
+	}
+
+private:
+	static constexpr size_t slot_count = 16;
+
+	struct alignas(64) slot
+	{
+		atomic<uint64_t> value{ 0 };
+	};
+
+	static size_t slot_index(void)
+	{
+		static atomic<size_t> next_slot{ 0 };
+		thread_local size_t index = next_slot.fetch_add(1, memory_order_relaxed) % slot_count;
+
+		return index;
+	}
+
+private:
+	array<slot, slot_count> _slots;
+};
+
+class latency_histogram
+{
+public:
+	void observe(const chrono::steady_clock::duration& duration)
+	{
+		long long microseconds = chrono::duration_cast<chrono::microseconds>(duration).count();
+
+		size_t bucket = 0;
+		while (bucket < _bounds.size() && microseconds > _bounds[bucket])
+		{
+			++bucket;
+		}
+
+		_buckets[bucket].add();
+		_sum.add((uint64_t)max<long long>(0, microseconds));
+	}
+
+	wstring metrics(const wstring& name) const
+	{
+		wstring result = fmt::format(L"# TYPE {} histogram\n", name);
+
+		uint64_t count = 0;
+		for (size_t bucket = 0; bucket < _buckets.size(); ++bucket)
+		{
+			count += _buckets[bucket].load();
+			result += fmt::format(L"{}_bucket{{le=\"{}\"}} {}\n", name, 
+				bucket < _bounds.size() ? fmt::format(L"{}", _bounds[bucket] / 1000000.0) : L"+Inf", count);
+		}
+		result += fmt::format(L"{}_sum {}\n{}_count {}\n", name, _sum.load() / 1000000.0, name, count);
+
+		return result;
+	}
+
+private:
+	// upper bounds in microseconds, and the last bucket takes the rest
+	const array<long long, 6> _bounds = { { 100, 1000, 10000, 100000, 1000000, 10000000 } };
+	array<metric_counter, 7> _buckets;
+	metric_counter _sum;
+};
+
+metric_counter _connected_sessions;
+metric_counter _disconnected_sessions;
+metric_counter _received_messages;
+metric_counter _received_binaries;
+metric_counter _received_binary_bytes;
+metric_counter _sent_messages;
+metric_counter _sent_heartbeats;
+metric_counter _expired_sessions;
+latency_histogram _queue_wait;
+latency_histogram _handler_time;
+atomic<bool> _metrics_stop{ false };
+thread _metrics_thread;
+
+class timer_wheel
+{
+public:
+	timer_wheel(const chrono::milliseconds& tick, const size_t& slot_count)
+		: _tick(tick), _cursor(0), _stop(true), _slots(slot_count)
+	{
+	}
+
+	~timer_wheel(void)
+	{
+		stop();
+	}
+
+	void start(void)
+	{
+		stop();
+
+		_stop = false;
+		_thread = thread(&timer_wheel::run, this);
+	}
+
+	void stop(void)
+	{
+		{
+			scoped_lock<mutex> guard(_mutex);
+
+			_stop = true;
+		}
+
+		_condition.notify_one();
+
+		if (_thread.joinable())
+		{
+			_thread.join();
+		}
+	}
+
+	// arming a key which is already armed replaces its timer. Sessions only arm on connection and when a timer fires,
+	// the callbacks compare the last seen time of the session instead of being re-armed by every message
+	void arm(const wstring& key, const chrono::milliseconds& delay, const function<void(void)>& callback)
+	{
+		size_t ticks = max<size_t>(1, (size_t)(delay / _tick));
+
+		scoped_lock<mutex> guard(_mutex);
+
+		remove(key);
+
+		size_t slot = (_cursor + ticks) % _slots.size();
+		_slots[slot].push_back({ key, (ticks - 1) / _slots.size(), callback });
+		_timers[key] = { slot, prev(_slots[slot].end()) };
+	}
+
+	void cancel(const wstring& key)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		remove(key);
+	}
+
+private:
+	struct timer
+	{
+		wstring key;
+		size_t rounds;
+		function<void(void)> callback;
+	};
+
+	void remove(const wstring& key)
+	{
+		auto target = _timers.find(key);
+		if (target == _timers.end())
+		{
+			return;
+		}
+
+		_slots[target->second.first].erase(target->second.second);
+		_timers.erase(target);
+	}
+
+	// a single thread advances one slot per tick, so arming and cancelling a timer is O(1)
+	// and only the timers hashed into the current slot are visited
+	void run(void)
+	{
+		auto next_tick = chrono::steady_clock::now() + _tick;
+
+		unique_lock<mutex> lock(_mutex);
+		while (!_condition.wait_until(lock, next_tick, [this]() { return _stop; }))
+		{
+			next_tick += _tick;
+			_cursor = (_cursor + 1) % _slots.size();
+
+			vector<function<void(void)>> expired;
+			auto& slot = _slots[_cursor];
+			for (auto target = slot.begin(); target != slot.end();)
+			{
+				if (target->rounds > 0)
+				{
+					--target->rounds;
+					++target;
+
+					continue;
+				}
+
+				expired.push_back(move(target->callback));
+				_timers.erase(target->key);
+				target = slot.erase(target);
+			}
+
+			lock.unlock();
+			for (auto& callback : expired)
+			{
+				callback();
+			}
+			lock.lock();
+		}
+	}
+
+private:
+	chrono::milliseconds _tick;
+	size_t _cursor;
+	bool _stop;
+	mutex _mutex;
+	condition_variable _condition;
+	thread _thread;
+	vector<list<timer>> _slots;
+	unordered_map<wstring, pair<size_t, list<timer>::iterator>> _timers;
+};
+
+timer_wheel _timer_wheel(chrono::milliseconds(100), 512);
+
+class capture_writer
+{
+public:
+	// a capture file starts with "ECAP" and is followed by frames of
+	// [elapsed microseconds: 8][session index: 4][session type: 1][payload size: 4][payload] in host byte order
+	bool open(const wstring& path)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		_stream.open(converter::to_string(path), ios::binary | ios::trunc);
+		if (!_stream.is_open())
+		{
+			return false;
+		}
+
+		_stream.write("ECAP", 4);
+		_started = chrono::steady_clock::now();
+		_opened = true;
+
+		return true;
+	}
+
+	// checked for every received message, so it does not take the lock
+	bool is_open(void)
+	{
+		return _opened.load(memory_order_relaxed);
+	}
+
+	void write(const wstring& session_key, const session_types& session_type, const vector<uint8_t>& payload)
+	{
+		uint64_t elapsed = (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - _started).count();
+		uint8_t type = (uint8_t)session_type;
+		uint32_t size = (uint32_t)payload.size();
+
+		scoped_lock<mutex> guard(_mutex);
+
+		if (!_stream.is_open())
+		{
+			return;
+		}
+
+		// sessions are numbered in the order of their first frame, so a replay can spread them over its connections
+		uint32_t session = (uint32_t)_sessions.insert({ session_key, (uint32_t)_sessions.size() }).first->second;
+
+		_stream.write((const char*)&elapsed, sizeof(elapsed));
+		_stream.write((const char*)&session, sizeof(session));
+		_stream.write((const char*)&type, sizeof(type));
+		_stream.write((const char*)&size, sizeof(size));
+		_stream.write((const char*)payload.data(), payload.size());
+
+		++_frames;
+	}
+
+	void close(void)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		if (!_stream.is_open())
+		{
+			return;
+		}
+
+		_opened = false;
+		_stream.close();
+
+		logger::handle().write(logging_level::information,
+			fmt::format(L"captured {} frames of {} sessions to {}", _frames, _sessions.size(), capture_file));
+	}
+
+private:
+	mutex _mutex;
+	ofstream _stream;
+	atomic<bool> _opened{ false };
+	chrono::steady_clock::time_point _started;
+	unordered_map<wstring, uint32_t> _sessions;
+	size_t _frames = 0;
+};
+
+capture_writer _capture_writer;
+
+vector<shared_ptr<thread_pool>> _thread_pools;
+
+// handlers are registered before any connection and never change afterwards,
+// so a job can keep a pointer to its handler instead of copying the std::function
+unordered_map<wstring, function<void(shared_ptr<container::value_container>)>> _registered_messages;
+
+shared_mutex _topic_mutex;
+map<wstring, map<wstring, pair<wstring, wstring>>> _topic_subscribers;
+
+class session_registry
+{
+public:
+	void insert(const wstring& id, const wstring& sub_id, const unsigned short& shard_index)
+	{
+		auto& target = stripe_of(id, sub_id);
+
+		unique_lock<shared_mutex> lock(target.guard);
+		auto& session = target.sessions[id][sub_id];
+		session.shard_index = shard_index;
+		session.last_seen.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+	}
+
+	void erase(const wstring& id, const wstring& sub_id)
+	{
+		auto& target = stripe_of(id, sub_id);
+
+		unique_lock<shared_mutex> lock(target.guard);
+		auto sessions = target.sessions.find(id);
+		if (sessions == target.sessions.end())
+		{
+			return;
+		}
+
+		sessions->second.erase(sub_id);
+		if (sessions->second.empty())
+		{
+			target.sessions.erase(sessions);
+		}
+	}
+
+	optional<unsigned short> find(const wstring& id, const wstring& sub_id)
+	{
+		auto& target = stripe_of(id, sub_id);
+
+		shared_lock<shared_mutex> lock(target.guard);
+		auto session = find_session(target, id, sub_id);
+		if (session == nullptr)
+		{
+			return nullopt;
+		}
+
+		return session->shard_index;
+	}
+
+	// only stores the time, so a message does not have to re-arm its heartbeat timer.
+	// returns false if the session is not routed, e.g. after it was expired
+	bool touch(const wstring& id, const wstring& sub_id)
+	{
+		auto& target = stripe_of(id, sub_id);
+
+		shared_lock<shared_mutex> lock(target.guard);
+		auto session = find_session(target, id, sub_id);
+		if (session == nullptr)
+		{
+			return false;
+		}
+
+		session->last_seen.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+
+		return true;
+	}
+
+	optional<chrono::steady_clock::time_point> last_seen(const wstring& id, const wstring& sub_id)
+	{
+		auto& target = stripe_of(id, sub_id);
+
+		shared_lock<shared_mutex> lock(target.guard);
+		auto session = find_session(target, id, sub_id);
+		if (session == nullptr)
+		{
+			return nullopt;
+		}
+
+		return chrono::steady_clock::time_point(chrono::steady_clock::duration(session->last_seen.load(memory_order_relaxed)));
+	}
+
+	// erases the session only if nothing arrived from it since the given time.
+	// touch() takes the shared lock of the same stripe, so a message is either seen here or finds the session erased
+	bool erase_idle(const wstring& id, const wstring& sub_id, const chrono::steady_clock::time_point& since)
+	{
+		auto& target = stripe_of(id, sub_id);
+
+		unique_lock<shared_mutex> lock(target.guard);
+		auto session = find_session(target, id, sub_id);
+		if (session == nullptr || session->last_seen.load(memory_order_relaxed) >= since.time_since_epoch().count())
+		{
+			return false;
+		}
+
+		auto sessions = target.sessions.find(id);
+		sessions->second.erase(sub_id);
+		if (sessions->second.empty())
+		{
+			target.sessions.erase(sessions);
+		}
+
+		return true;
+	}
+
+private:
+	// sessions are spread over independent stripes by the hash of their id and sub_id,
+	// so senders on different workers rarely wait for the same lock and lookups only take a shared lock.
+	// Both levels are looked up with the strings of the message itself, so a lookup never allocates a key.
+	struct session
+	{
+		unsigned short shard_index = 0;
+		atomic<chrono::steady_clock::rep> last_seen{ 0 };
+	};
+
+	struct alignas(64) stripe
+	{
+		shared_mutex guard;
+		unordered_map<wstring, unordered_map<wstring, session>> sessions;
+	};
+
+	session* find_session(stripe& target, const wstring& id, const wstring& sub_id)
+	{
+		auto sessions = target.sessions.find(id);
+		if (sessions == target.sessions.end())
+		{
+			return nullptr;
+		}
+
+		auto session = sessions->second.find(sub_id);
+		if (session == sessions->second.end())
+		{
+			return nullptr;
+		}
+
+		return &session->second;
+	}
+
+	stripe& stripe_of(const wstring& id, const wstring& sub_id)
+	{
+		size_t seed = hash<wstring>{}(id);
+		seed ^= hash<wstring>{}(sub_id) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+
+		return _stripes[seed % _stripes.size()];
+	}
 
-shared_ptr<thread_pool> _thread_pool = nullptr;
+private:
+	array<stripe, 64> _stripes;
+};
 
-map<wstring, function<void(const vector<uint8_t>&)>> _registered_messages;
+session_registry _session_shards;
 
-shared_ptr<messaging_server> _server = nullptr;
+vector<shared_ptr<messaging_server>> _servers;
 
 bool parse_arguments(argument_manager& arguments);
 void display_help(void);
 
-void create_server(void);
-void create_thread_pool(void);
-void connection(const wstring& target_id, const wstring& target_sub_id, const bool& condition);
-void received_message(shared_ptr<container::value_container> container);
+void register_message(const wstring& message_type, const function<void(shared_ptr<container::value_container>)>& handler);
+
+void create_servers(void);
+void create_server(const unsigned short& shard_index);
+void create_thread_pools(void);
+void create_thread_pool(const unsigned short& shard_index);
+shared_ptr<messaging_server> route(const wstring& target_id, const wstring& target_sub_id);
+void send_message(shared_ptr<container::value_container> message);
+void connection(const unsigned short& shard_index, const wstring& target_id, const wstring& target_sub_id, const bool& condition);
+void received_message(const unsigned short& shard_index, shared_ptr<container::value_container> container);
 void received_binary_message(const wstring& source_id, const wstring& source_sub_id, 
 	const wstring& target_id, const wstring& target_sub_id, const vector<uint8_t>& data);
-void received_echo_test(const vector<uint8_t>& data);
+void received_echo_test(shared_ptr<container::value_container> container);
+void received_subscribe(shared_ptr<container::value_container> container);
+void received_unsubscribe(shared_ptr<container::value_container> container);
+void received_publish(shared_ptr<container::value_container> container);
+void received_heartbeat(shared_ptr<container::value_container> container);
+void touch_session(const unsigned short& shard_index, const wstring& target_id, const wstring& target_sub_id);
+void watch_session(const wstring& session_key, const wstring& target_id, const wstring& target_sub_id);
+void send_heartbeat(const wstring& session_key, const wstring& target_id, const wstring& target_sub_id);
+void expire_session(const wstring& session_key, const wstring& target_id, const wstring& target_sub_id, 
+	const chrono::steady_clock::time_point& probed);
+void remove_session(const wstring& session_key, const wstring& target_id, const wstring& target_sub_id);
+void remove_subscriptions(const wstring& session_key);
+wstring topic_of(shared_ptr<container::value_container> container);
+bool create_signal_pipe(void);
+void wait_signal(void);
+void change_logging_level(const int& step);
+bool acquire_pending_job(void);
+void release_pending_job(void);
+void drain(void);
 void signal_callback(int signum);
+bool start_metrics_endpoint(void);
+void stop_metrics_endpoint(void);
+void serve_metrics(const intptr_t& listener);
+bool wait_readable(const intptr_t& socket, const int& timeout);
+wstring collect_metrics(void);
 
 int main(int argc, char* argv[])
 {
@@ -107,12 +795,23 @@ int main(int argc, char* argv[])
 		return 0;
 	}
 
+	if (!create_signal_pipe())
+	{
+		return 0;
+	}
+
 	signal(SIGINT, signal_callback);
 	signal(SIGILL, signal_callback);
 	signal(SIGABRT, signal_callback);
 	signal(SIGFPE, signal_callback);
 	signal(SIGSEGV, signal_callback);
 	signal(SIGTERM, signal_callback);
+#ifndef _WIN32
+	signal(SIGUSR1, signal_callback);
+	signal(SIGUSR2, signal_callback);
+#endif
+
+	_log_level = (int)log_level;
 
 	logger::handle().set_write_console(logging_style);
 	logger::handle().set_target_level(log_level);
@@ -122,15 +821,40 @@ int main(int argc, char* argv[])
 	logger::handle().start(PROGRAM_NAME);
 #endif
 
-	_registered_messages.insert({ L"echo_test", received_echo_test });
+	register_message(L"echo_test", received_echo_test);
+	register_message(L"subscribe", received_subscribe);
+	register_message(L"unsubscribe", received_unsubscribe);
+	register_message(L"publish", received_publish);
+	register_message(L"heartbeat", received_heartbeat);
+
+	if (heartbeat_interval > 0)
+	{
+		_timer_wheel.start();
+	}
+
+	if (!capture_file.empty() && !_capture_writer.open(capture_file))
+	{
+		logger::handle().write(logging_level::error, fmt::format(L"cannot open a capture file: {}", capture_file));
+	}
+
+	create_thread_pools();
+
+	create_servers();
+
+	if (metrics_port > 0 && !start_metrics_endpoint())
+	{
+		logger::handle().write(logging_level::error, fmt::format(L"cannot open a metrics endpoint on {}", metrics_port));
+	}
 
-	create_thread_pool();
+	wait_signal();
 
-	create_server();
+	drain();
 
-	_server->wait_stop();
+	stop_metrics_endpoint();
 
-	_thread_pool->stop();
+	_capture_writer.close();
+
+	logger::handle().write(logging_level::information, _outbound_limiter.status());
 
 	logger::handle().stop();
 
@@ -189,16 +913,70 @@ bool parse_arguments(argument_manager& arguments)
 		server_port = *ushort_target;
 	}
 
-	ushort_target = arguments.to_ushort(L"--high_priority_count");
-	if (ushort_target != nullopt)
+	ushort_target = arguments.to_ushort(L"--shard_count");
+	if (ushort_target != nullopt && *ushort_target > 0)
 	{
-		high_priority_count = *ushort_target;
+		shard_count = *ushort_target;
 	}
 
-	ushort_target = arguments.to_ushort(L"--normal_priority_count");
+	ushort_target = arguments.to_ushort(L"--drain_timeout");
 	if (ushort_target != nullopt)
 	{
-		normal_priority_count = *ushort_target;
+		drain_timeout = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--heartbeat_interval");
+	if (ushort_target != nullopt)
+	{
+		heartbeat_interval = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--idle_timeout");
+	if (ushort_target != nullopt && *ushort_target > 0)
+	{
+		idle_timeout = *ushort_target;
+	}
+
+	string_target = arguments.to_string(L"--capture_file");
+	if (string_target != nullopt)
+	{
+		capture_file = *string_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--metrics_port");
+	if (ushort_target != nullopt)
+	{
+		metrics_port = *ushort_target;
+	}
+
+	bool_target = arguments.to_bool(L"--metrics_loopback_only");
+	if (bool_target != nullopt)
+	{
+		metrics_loopback_only = *bool_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--log_rate_limit");
+	if (ushort_target != nullopt)
+	{
+		log_rate_limit = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--log_sampling");
+	if (ushort_target != nullopt && *ushort_target > 0)
+	{
+		log_sampling = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--high_priority_count");
+	if (ushort_target != nullopt)
+	{
+		high_priority_count = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--normal_priority_count");
+	if (ushort_target != nullopt)
+	{
+		normal_priority_count = *ushort_target;
 	}
 
 	ushort_target = arguments.to_ushort(L"--low_priority_count");
@@ -219,13 +997,43 @@ bool parse_arguments(argument_manager& arguments)
 	{
 		session_limit_count = *ullong_target;
 	}
+
+	ullong_target = arguments.to_ullong(L"--session_outbound_limit");
+	if (ullong_target != nullopt)
+	{
+		session_outbound_limit = *ullong_target;
+	}
+
+	ullong_target = arguments.to_ullong(L"--global_outbound_limit");
+	if (ullong_target != nullopt)
+	{
+		global_outbound_limit = *ullong_target;
+	}
 #else
 	auto ulong_target = arguments.to_ulong(L"--session_limit_count");
 	if (ulong_target != nullopt)
 	{
 		session_limit_count = *ulong_target;
 	}
+
+	ulong_target = arguments.to_ulong(L"--session_outbound_limit");
+	if (ulong_target != nullopt)
+	{
+		session_outbound_limit = *ulong_target;
+	}
+
+	ulong_target = arguments.to_ulong(L"--global_outbound_limit");
+	if (ulong_target != nullopt)
+	{
+		global_outbound_limit = *ulong_target;
+	}
 #endif
+
+	string_target = arguments.to_string(L"--backpressure_policy");
+	if (string_target != nullopt)
+	{
+		backpressure_drop = (*string_target == L"drop");
+	}
 	
 	bool_target = arguments.to_bool(L"--write_console_only");
 	if (bool_target != nullopt && *bool_target)
@@ -261,6 +1069,20 @@ void display_help(void)
 	wcout << L"\tIf you want to change a specific key string for the connection to the main server must be appended\n\t'--connection_key [specific key string]'." << endl << endl;
 	wcout << L"--server_port [value]" << endl;
 	wcout << L"\tIf you want to change a port number for the connection to the main server must be appended\n\t'--server_port [port number]'." << endl << endl;
+	wcout << L"--shard_count [value]" << endl;
+	wcout << L"\tIf you want to run several server shards with their own thread pools must be appended '--shard_count [count]'.\n\tEach shard listens on the port number plus its index.\n\tInitialize value is --shard_count 1." << endl << endl;
+	wcout << L"--drain_timeout [value]" << endl;
+	wcout << L"\tIf you want to change how long(ms) queued echo jobs are waited for after SIGINT or SIGTERM must be appended\n\t'--drain_timeout [milliseconds]'.\n\tInitialize value is --drain_timeout 5000." << endl << endl;
+	wcout << L"--heartbeat_interval [value]" << endl;
+	wcout << L"\tIf you want to send a heartbeat to a session which has been silent for a while must be appended\n\t'--heartbeat_interval [seconds]'. It is not used with --binary_mode.\n\tInitialize value is --heartbeat_interval 0(disabled)." << endl << endl;
+	wcout << L"--idle_timeout [value]" << endl;
+	wcout << L"\tIf you want to change how long(s) a heartbeat is waited for before the session is expired must be appended\n\t'--idle_timeout [seconds]'.\n\tInitialize value is --idle_timeout 30." << endl << endl;
+	wcout << L"--capture_file [value]" << endl;
+	wcout << L"\tIf you want to record every received message to replay it with replay_client must be appended\n\t'--capture_file [file path]'." << endl << endl;
+	wcout << L"--metrics_port [value]" << endl;
+	wcout << L"\tIf you want to expose counters and histograms in the Prometheus text format over http must be appended\n\t'--metrics_port [port number]'.\n\tInitialize value is --metrics_port 0(disabled)." << endl << endl;
+	wcout << L"--metrics_loopback_only [value]" << endl;
+	wcout << L"\tIf you want to answer scrapes from other hosts than localhost must be appended '--metrics_loopback_only false'.\n\tInitialize value is --metrics_loopback_only true." << endl << endl;
 	wcout << L"--high_priority_count [value]" << endl;
 	wcout << L"\tIf you want to change high priority thread workers must be appended '--high_priority_count [count]'." << endl << endl;
 	wcout << L"--normal_priority_count [value]" << endl;
@@ -269,123 +1091,826 @@ void display_help(void)
 	wcout << L"\tIf you want to change low priority thread workers must be appended '--low_priority_count [count]'." << endl << endl;
 	wcout << L"--session_limit_count [value]" << endl;
 	wcout << L"\tIf you want to change session limit count must be appended '--session_limit_count [count]'." << endl << endl;
+	wcout << L"--session_outbound_limit [value]" << endl;
+	wcout << L"\tIf you want to limit the bytes of messages waiting in the echo job queue for each session must be appended\n\t'--session_outbound_limit [bytes]'. The bytes queued inside messaging_server are not counted.\n\tInitialize value is --session_outbound_limit 0(unlimited)." << endl << endl;
+	wcout << L"--global_outbound_limit [value]" << endl;
+	wcout << L"\tIf you want to limit the bytes of messages waiting in the echo job queue for all sessions must be appended\n\t'--global_outbound_limit [bytes]'.\n\tInitialize value is --global_outbound_limit 0(unlimited)." << endl << endl;
+	wcout << L"--backpressure_policy [value]" << endl;
+	wcout << L"\tIf you want to drop messages over the outbound limits instead of blocking must be appended\n\t'--backpressure_policy drop'.\n\tBlocking holds the messaging_server thread which received the message, so every session served by that thread waits.\n\tInitialize value is --backpressure_policy block." << endl << endl;
 	wcout << L"--write_console [value] " << endl;
 	wcout << L"\tThe write_console_mode on/off. If you want to display log on console must be appended '--write_console true'.\n\tInitialize value is --write_console off." << endl << endl;
+	wcout << L"--log_rate_limit [value]" << endl;
+	wcout << L"\tIf you want to limit the lines written per second by each received message log must be appended\n\t'--log_rate_limit [lines]'.\n\tInitialize value is --log_rate_limit 0(unlimited)." << endl << endl;
+	wcout << L"--log_sampling [value]" << endl;
+	wcout << L"\tIf you want to write only one of every N received message logs must be appended '--log_sampling [N]'.\n\tInitialize value is --log_sampling 1." << endl << endl;
 	wcout << L"--logging_level [value]" << endl;
-	wcout << L"\tIf you want to change log level must be appended '--logging_level [level]'." << endl;
+	wcout << L"\tIf you want to change log level must be appended '--logging_level [level]'.\n\tWhile running, SIGUSR1 raises and SIGUSR2 lowers the level by one." << endl;
+}
+
+void register_message(const wstring& message_type, const function<void(shared_ptr<container::value_container>)>& handler)
+{
+	_registered_messages[message_type] = handler;
+}
+
+void create_servers(void)
+{
+	_servers.clear();
+	_servers.resize(shard_count, nullptr);
+
+	for (unsigned short shard_index = 0; shard_index < shard_count; ++shard_index)
+	{
+		create_server(shard_index);
+	}
 }
 
-void create_server(void)
+void create_server(const unsigned short& shard_index)
 {
-	if (_server != nullptr)
+	auto& server = _servers[shard_index];
+	if (server != nullptr)
 	{
-		_server.reset();
+		server.reset();
 	}
 
-	_server = make_shared<messaging_server>(PROGRAM_NAME);
-	_server->set_encrypt_mode(encrypt_mode);
-	_server->set_compress_mode(compress_mode);
-	_server->set_connection_key(connection_key);
-	_server->set_session_limit_count(session_limit_count);
-	_server->set_connection_notification(&connection);
+	server = make_shared<messaging_server>(PROGRAM_NAME);
+	server->set_encrypt_mode(encrypt_mode);
+	server->set_compress_mode(compress_mode);
+	server->set_connection_key(connection_key);
+	server->set_session_limit_count(session_limit_count);
+	server->set_connection_notification(
+		[shard_index](const wstring& target_id, const wstring& target_sub_id, const bool& condition)
+		{
+			connection(shard_index, target_id, target_sub_id, condition);
+		});
 	if (binary_mode)
 	{
-		_server->set_binary_notification(&received_binary_message);
-		_server->set_possible_session_types({ session_types::binary_line });
+		server->set_binary_notification(&received_binary_message);
+		server->set_possible_session_types({ session_types::binary_line });
 	}
 	else
 	{
-		_server->set_message_notification(&received_message);
-		_server->set_possible_session_types({ session_types::message_line });
+		server->set_message_notification(
+			[shard_index](shared_ptr<container::value_container> container)
+			{
+				received_message(shard_index, container);
+			});
+		server->set_possible_session_types({ session_types::message_line });
 	}
-	_server->start(server_port, high_priority_count, normal_priority_count, low_priority_count);
+	server->start(server_port + shard_index, high_priority_count, normal_priority_count, low_priority_count);
 }
 
-void create_thread_pool(void)
+void create_thread_pools(void)
 {
-	if (_thread_pool != nullptr)
+	_thread_pools.clear();
+	_thread_pools.resize(shard_count, nullptr);
+
+	for (unsigned short shard_index = 0; shard_index < shard_count; ++shard_index)
 	{
-		_thread_pool.reset();
+		create_thread_pool(shard_index);
 	}
+}
 
-	_thread_pool = make_shared<thread_pool>();
+void create_thread_pool(const unsigned short& shard_index)
+{
+	auto& pool = _thread_pools[shard_index];
+	if (pool != nullptr)
+	{
+		pool.reset();
+	}
+
+	pool = make_shared<thread_pool>();
 	for (unsigned short high = 0; high < high_priority_count; ++high)
 	{
-		_thread_pool->append(make_shared<thread_worker>(priorities::high));
+		pool->append(make_shared<thread_worker>(priorities::high));
 	}
 	for (unsigned short normal = 0; normal < normal_priority_count; ++normal)
 	{
-		_thread_pool->append(make_shared<thread_worker>(priorities::normal, vector<priorities> { priorities::high }));
+		pool->append(make_shared<thread_worker>(priorities::normal, vector<priorities> { priorities::high }));
 	}
 	for (unsigned short low = 0; low < low_priority_count; ++low)
 	{
-		_thread_pool->append(make_shared<thread_worker>(priorities::low, vector<priorities> { priorities::high, priorities::normal }));
+		pool->append(make_shared<thread_worker>(priorities::low, vector<priorities> { priorities::high, priorities::normal }));
 	}
-	_thread_pool->start();
+	pool->start();
 }
 
-void connection(const wstring& target_id, const wstring& target_sub_id, const bool& condition)
+shared_ptr<messaging_server> route(const wstring& target_id, const wstring& target_sub_id)
+{
+	auto shard_index = _session_shards.find(target_id, target_sub_id);
+	if (shard_index == nullopt)
+	{
+		return nullptr;
+	}
+
+	return _servers[*shard_index];
+}
+
+void send_message(shared_ptr<container::value_container> message)
+{
+	_sent_messages.add();
+
+	auto server = route(message->target_id(), message->target_sub_id());
+	if (server != nullptr)
+	{
+		server->send(message);
+
+		return;
+	}
+
+	// an unknown session is handed to every shard and only the shard owning it will deliver
+	for (auto& shard : _servers)
+	{
+		shard->send(message);
+	}
+}
+
+void connection(const unsigned short& shard_index, const wstring& target_id, const wstring& target_sub_id, const bool& condition)
 {
 	logger::handle().write(logging_level::information,
-		fmt::format(L"an echo_client({}[{}]) is {} an echo_server", target_id, target_sub_id, 
-			condition ? L"connected to" : L"disconnected from"));
+		fmt::format(L"an echo_client({}[{}]) is {} an echo_server[{}]", target_id, target_sub_id, 
+			condition ? L"connected to" : L"disconnected from", shard_index));
+
+	wstring session_key = fmt::format(L"{}[{}]", target_id, target_sub_id);
+
+	(condition ? _connected_sessions : _disconnected_sessions).add();
+
+	if (condition)
+	{
+		_session_shards.insert(target_id, target_sub_id, shard_index);
+		watch_session(session_key, target_id, target_sub_id);
+
+		return;
+	}
+
+	_timer_wheel.cancel(session_key);
+
+	remove_session(session_key, target_id, target_sub_id);
+}
+
+void remove_session(const wstring& session_key, const wstring& target_id, const wstring& target_sub_id)
+{
+	_session_shards.erase(target_id, target_sub_id);
+
+	remove_subscriptions(session_key);
 }
 
-void received_message(shared_ptr<container::value_container> container)
+void remove_subscriptions(const wstring& session_key)
+{
+	scoped_lock<shared_mutex> guard(_topic_mutex);
+	for (auto topic = _topic_subscribers.begin(); topic != _topic_subscribers.end();)
+	{
+		topic->second.erase(session_key);
+		if (topic->second.empty())
+		{
+			topic = _topic_subscribers.erase(topic);
+
+			continue;
+		}
+
+		++topic;
+	}
+}
+
+void received_message(const unsigned short& shard_index, shared_ptr<container::value_container> container)
 {
 	if (container == nullptr)
 	{
 		return;
 	}
 
+	if (_draining.load(memory_order_relaxed))
+	{
+		return;
+	}
+
+	_received_messages.add();
+
+	// the session key is only built by the features which use it, so a plain echo does not format it
+	touch_session(shard_index, container->source_id(), container->source_sub_id());
+
+	if (_capture_writer.is_open())
+	{
+		_capture_writer.write(fmt::format(L"{}[{}]", container->source_id(), container->source_sub_id()), 
+			session_types::message_line, converter::to_array(container->serialize()));
+	}
+
 	auto message_type = _registered_messages.find(container->message_type());
 	if (message_type != _registered_messages.end())
 	{
-		if (_thread_pool)
+		auto pool = _thread_pools[shard_index];
+		if (pool)
 		{
-			_thread_pool->push(make_shared<job>(priorities::high, 
-				converter::to_array(container->serialize()), message_type->second));
+			// the received container is handed to the job as it is instead of being serialized and parsed again,
+			// so only the outbound limits pay for encoding the message to know its size,
+			// and without any limit the limiter is not touched at all
+			if (!acquire_pending_job())
+			{
+				return;
+			}
+
+			size_t size = 0;
+			wstring session_key;
+			bool limited = _outbound_limiter.enabled();
+			if (limited)
+			{
+				session_key = fmt::format(L"{}[{}]", container->source_id(), container->source_sub_id());
+				size = converter::to_array(container->serialize()).size();
+
+				if (!_outbound_limiter.reserve(session_key, size))
+				{
+					logger::handle().write(logging_level::error,
+						fmt::format(L"dropped message from {}: {}", session_key, _outbound_limiter.status()));
+
+					release_pending_job();
+
+					return;
+				}
+			}
+
+			auto callback = &message_type->second;
+			pool->push(make_shared<job>(priorities::high, 
+				[callback, container, session_key, size, limited, queued = chrono::steady_clock::now()]()
+				{
+					auto started = chrono::steady_clock::now();
+					_queue_wait.observe(started - queued);
+
+					(*callback)(container);
+					if (limited)
+					{
+						_outbound_limiter.release(session_key, size);
+					}
+
+					_handler_time.observe(chrono::steady_clock::now() - started);
+
+					release_pending_job();
+				}));
 		}
 
 		return;
 	}
 
-	logger::handle().write(logging_level::information,
-		fmt::format(L"received message: {}", container->serialize()));
+	if (_received_message_log.enabled())
+	{
+		logger::handle().write(_received_message_log.level(),
+			fmt::format(L"received message: {}", container->serialize()));
+	}
 }
 
 void received_binary_message(const wstring& source_id, const wstring& source_sub_id, 
 	const wstring& target_id, const wstring& target_sub_id, const vector<uint8_t>& data)
 {
-	logger::handle().write(logging_level::information,
-		fmt::format(L"received message: {}[{}] = {}", source_id, source_sub_id, converter::to_wstring(data)));
+	if (_draining.load(memory_order_relaxed))
+	{
+		return;
+	}
+
+	if (_received_binary_log.enabled())
+	{
+		logger::handle().write(_received_binary_log.level(),
+			fmt::format(L"received message: {}[{}] = {}", source_id, source_sub_id, converter::to_wstring(data)));
+	}
+
+	_received_binaries.add();
+	_received_binary_bytes.add(data.size());
+
+	if (_capture_writer.is_open())
+	{
+		_capture_writer.write(fmt::format(L"{}[{}]", source_id, source_sub_id), session_types::binary_line, data);
+	}
+
+	auto server = route(source_id, source_sub_id);
+	if (server != nullptr)
+	{
+		server->send_binary(source_id, source_sub_id, data);
+
+		return;
+	}
+
+	for (auto& shard : _servers)
+	{
+		shard->send_binary(source_id, source_sub_id, data);
+	}
+}
+
+void received_echo_test(shared_ptr<container::value_container> container)
+{
+	if (container == nullptr)
+	{
+		return;
+	}
+
+	if (_received_echo_log.enabled())
+	{
+		logger::handle().write(_received_echo_log.level(), 
+			fmt::format(L"received message: {}", container->serialize()));
+	}
+
+	// the received container belongs to this job only, so the reply is the same container with its header swapped
+	// instead of a copy of every value
+	container->swap_header();
+
+	send_message(container);
+}
+
+void received_subscribe(shared_ptr<container::value_container> container)
+{
+	wstring topic = topic_of(container);
+	if (topic.empty())
+	{
+		return;
+	}
+
+	{
+		scoped_lock<shared_mutex> guard(_topic_mutex);
+
+		_topic_subscribers[topic].insert({ fmt::format(L"{}[{}]", container->source_id(), container->source_sub_id()),
+			{ container->source_id(), container->source_sub_id() } });
+	}
 
-	_server->send_binary(source_id, source_sub_id, data);
+	logger::handle().write(logging_level::sequence,
+		fmt::format(L"{}[{}] subscribed to {}", container->source_id(), container->source_sub_id(), topic));
+
+	container->swap_header();
+
+	send_message(container);
 }
 
-void received_echo_test(const vector<uint8_t>& data)
+void received_unsubscribe(shared_ptr<container::value_container> container)
 {
-	if (data.empty())
+	wstring topic = topic_of(container);
+	if (topic.empty())
 	{
 		return;
 	}
 
-	shared_ptr<container::value_container> container = make_shared<container::value_container>(data, false);
+	{
+		scoped_lock<shared_mutex> guard(_topic_mutex);
+
+		auto target = _topic_subscribers.find(topic);
+		if (target != _topic_subscribers.end())
+		{
+			target->second.erase(fmt::format(L"{}[{}]", container->source_id(), container->source_sub_id()));
+			if (target->second.empty())
+			{
+				_topic_subscribers.erase(target);
+			}
+		}
+	}
+
+	container->swap_header();
+
+	send_message(container);
+}
+
+void received_publish(shared_ptr<container::value_container> container)
+{
+	auto start = logger::handle().chrono_start();
+
+	wstring topic = topic_of(container);
+	if (topic.empty())
+	{
+		return;
+	}
+
+	vector<pair<wstring, wstring>> subscribers;
+	{
+		shared_lock<shared_mutex> guard(_topic_mutex);
+
+		auto target = _topic_subscribers.find(topic);
+		if (target == _topic_subscribers.end())
+		{
+			return;
+		}
+
+		subscribers.reserve(target->second.size());
+		for (auto& subscriber : target->second)
+		{
+			subscribers.push_back(subscriber.second);
+		}
+	}
+
+	// the published values are parsed once and shared by reference with every subscriber message,
+	// so only a header is created per subscriber instead of copying the whole container
+	vector<shared_ptr<container::value>> units = container->value_array(L"topic");
+	auto payload = container->value_array(L"payload");
+	units.insert(units.end(), payload.begin(), payload.end());
+
+	for (auto& subscriber : subscribers)
+	{
+		send_message(make_shared<container::value_container>(container->source_id(), container->source_sub_id(),
+			subscriber.first, subscriber.second, L"publish", units));
+	}
+
+	logger::handle().write(logging_level::sequence,
+		fmt::format(L"published {} to {} subscribers", topic, subscribers.size()), start);
+}
+
+void received_heartbeat(shared_ptr<container::value_container> container)
+{
 	if (container == nullptr)
 	{
 		return;
 	}
 
+	logger::handle().write(logging_level::sequence,
+		fmt::format(L"received heartbeat from {}[{}]", container->source_id(), container->source_sub_id()));
+}
+
+void touch_session(const unsigned short& shard_index, const wstring& target_id, const wstring& target_sub_id)
+{
+	if (heartbeat_interval == 0 || binary_mode)
+	{
+		return;
+	}
+
+	// the timers check the last seen time when they fire, so a message only stores it
+	if (_session_shards.touch(target_id, target_sub_id))
+	{
+		return;
+	}
+
+	// a session which talks again after it was expired is routed and watched again
+	_session_shards.insert(target_id, target_sub_id, shard_index);
+	watch_session(fmt::format(L"{}[{}]", target_id, target_sub_id), target_id, target_sub_id);
+}
+
+void watch_session(const wstring& session_key, const wstring& target_id, const wstring& target_sub_id)
+{
+	// a heartbeat is a container message, so binary_line sessions are not watched
+	if (heartbeat_interval == 0 || binary_mode)
+	{
+		return;
+	}
+
+	_timer_wheel.arm(session_key, chrono::seconds(heartbeat_interval),
+		[session_key, target_id, target_sub_id]()
+		{
+			send_heartbeat(session_key, target_id, target_sub_id);
+		});
+}
+
+void send_heartbeat(const wstring& session_key, const wstring& target_id, const wstring& target_sub_id)
+{
+	auto last_seen = _session_shards.last_seen(target_id, target_sub_id);
+	if (last_seen == nullopt)
+	{
+		return;
+	}
+
+	// the session talked after the timer was armed, so only the rest of the interval is waited for
+	auto now = chrono::steady_clock::now();
+	if (now - *last_seen < chrono::seconds(heartbeat_interval))
+	{
+		_timer_wheel.arm(session_key, 
+			chrono::duration_cast<chrono::milliseconds>(*last_seen + chrono::seconds(heartbeat_interval) - now),
+			[session_key, target_id, target_sub_id]()
+			{
+				send_heartbeat(session_key, target_id, target_sub_id);
+			});
+
+		return;
+	}
+
+	_timer_wheel.arm(session_key, chrono::seconds(idle_timeout),
+		[session_key, target_id, target_sub_id, now]()
+		{
+			expire_session(session_key, target_id, target_sub_id, now);
+		});
+
+	_sent_heartbeats.add();
+
+	send_message(make_shared<container::value_container>(PROGRAM_NAME, L"", target_id, target_sub_id, L"heartbeat", 
+		vector<shared_ptr<container::value>> {}));
+}
+
+void expire_session(const wstring& session_key, const wstring& target_id, const wstring& target_sub_id, 
+	const chrono::steady_clock::time_point& probed)
+{
+	// any message after the heartbeat, including its reply, keeps the session and restarts the heartbeat timer
+	if (!_session_shards.erase_idle(target_id, target_sub_id, probed))
+	{
+		send_heartbeat(session_key, target_id, target_sub_id);
+
+		return;
+	}
+
+	logger::handle().write(logging_level::error,
+		fmt::format(L"{} did not answer a heartbeat in {} seconds and is expired", session_key, idle_timeout));
+
+	_expired_sessions.add();
+
+	remove_subscriptions(session_key);
+}
+
+wstring topic_of(shared_ptr<container::value_container> container)
+{
+	if (container == nullptr)
+	{
+		return L"";
+	}
+
+	auto topic = container->value_array(L"topic");
+	if (topic.empty())
+	{
+		return L"";
+	}
+
+	return topic[0]->to_string();
+}
+
+bool create_signal_pipe(void)
+{
+#ifdef _WIN32
+	if (_pipe(_signal_pipe, 16, O_BINARY) != 0)
+#else
+	if (pipe(_signal_pipe) != 0)
+#endif
+	{
+		wcout << L"cannot create a signal pipe" << endl;
+
+		return false;
+	}
+
+	return true;
+}
+
+void wait_signal(void)
+{
+	char signal_number = 0;
+	while (true)
+	{
+#ifdef _WIN32
+		if (_read(_signal_pipe[0], &signal_number, 1) != 1)
+#else
+		if (read(_signal_pipe[0], &signal_number, 1) != 1)
+#endif
+		{
+			continue;
+		}
+
+#ifndef _WIN32
+		if (signal_number == SIGUSR1 || signal_number == SIGUSR2)
+		{
+			change_logging_level(signal_number == SIGUSR1 ? 1 : -1);
+
+			continue;
+		}
+#endif
+
+		break;
+	}
+
 	logger::handle().write(logging_level::information, 
-		fmt::format(L"received message: {}", container->serialize()));
+		fmt::format(L"received signal({}), start to drain", (int)signal_number));
+}
+
+void change_logging_level(const int& step)
+{
+	int level = clamp(_log_level.load() + step, (int)logging_level::exception, (int)logging_level::packet);
 
-	shared_ptr<container::value_container> message = container->copy(false);
-	message->swap_header();
+	_log_level = level;
+	logger::handle().set_target_level((logging_level)level);
 
-	_server->send(message);
+	logger::handle().write(logging_level::information, fmt::format(L"logging level is changed to {}", level));
+}
+
+// the job is counted before _draining is checked, and drain() sets _draining before it reads the count.
+// Both are sequentially consistent, so either drain() waits for the job or the job is not queued.
+bool acquire_pending_job(void)
+{
+	_pending_jobs.fetch_add(1);
+	if (!_draining.load())
+	{
+		return true;
+	}
+
+	release_pending_job();
+
+	return false;
+}
+
+void release_pending_job(void)
+{
+	if (_pending_jobs.fetch_sub(1) == 1 && _draining.load())
+	{
+		scoped_lock<mutex> guard(_drain_mutex);
+
+		_drain_condition.notify_all();
+	}
+}
+
+void drain(void)
+{
+	// new messages are rejected first, then the queued echo jobs hand their replies to the sessions
+	// before the servers are stopped, and whatever is still queued after drain_timeout is dropped
+	auto start = logger::handle().chrono_start();
+
+	_draining = true;
+
+	bool drained = false;
+	{
+		unique_lock<mutex> lock(_drain_mutex);
+
+		drained = _drain_condition.wait_for(lock, chrono::milliseconds(drain_timeout), 
+			[]() { return _pending_jobs.load() == 0; });
+	}
+
+	_timer_wheel.stop();
+
+	for (auto& server : _servers)
+	{
+		server->stop();
+	}
+
+	for (auto& pool : _thread_pools)
+	{
+		pool->stop(!drained);
+	}
+
+	logger::handle().write(logging_level::information, 
+		drained ? L"drained every queued echo job" : L"forced to stop after drain_timeout", start);
 }
 
 void signal_callback(int signum)
 {
-	_server->stop();
+	// only async-signal-safe calls are allowed here, so the main thread is woken up through the pipe
+#ifdef _WIN32
+	if (signum != SIGINT && signum != SIGTERM)
+#else
+	if (signum != SIGINT && signum != SIGTERM && signum != SIGUSR1 && signum != SIGUSR2)
+#endif
+	{
+		signal(signum, SIG_DFL);
+		raise(signum);
+
+		return;
+	}
+
+	char signal_number = (char)signum;
+#ifdef _WIN32
+	if (_write(_signal_pipe[1], &signal_number, 1) < 0)
+#else
+	if (write(_signal_pipe[1], &signal_number, 1) < 0)
+#endif
+	{
+		return;
+	}
+}
+
+bool start_metrics_endpoint(void)
+{
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+	{
+		return false;
+	}
+
+	SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener == INVALID_SOCKET)
+#else
+	int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener < 0)
+#endif
+	{
+		return false;
+	}
+
+	int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(metrics_loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+	address.sin_port = htons(metrics_port);
+
+	if (::bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0)
+	{
+#ifdef _WIN32
+		closesocket(listener);
+#else
+		close(listener);
+#endif
+
+		return false;
+	}
+
+	_metrics_stop = false;
+	_metrics_thread = thread(&serve_metrics, (intptr_t)listener);
+
+	logger::handle().write(logging_level::information, fmt::format(L"metrics endpoint is listening on {}", metrics_port));
+
+	return true;
+}
+
+void stop_metrics_endpoint(void)
+{
+	_metrics_stop = true;
+
+	if (_metrics_thread.joinable())
+	{
+		_metrics_thread.join();
+	}
+}
+
+void serve_metrics(const intptr_t& listener)
+{
+	// a scrape is rare compared with the messages, so one thread answers every request in turn
+	// and wakes up regularly only to notice the shutdown
+	while (!_metrics_stop)
+	{
+		if (!wait_readable(listener, 200))
+		{
+			continue;
+		}
+
+		auto session = accept(listener, nullptr, nullptr);
+#ifdef _WIN32
+		if (session == INVALID_SOCKET)
+#else
+		if (session < 0)
+#endif
+		{
+			continue;
+		}
+
+		// a client which connects without sending its request is dropped after the same wait,
+		// so it can not hold the only metrics thread or the shutdown
+		char request[1024];
+		if (!wait_readable(session, 200) || recv(session, request, sizeof(request), 0) <= 0)
+		{
+#ifdef _WIN32
+			closesocket(session);
+#else
+			close(session);
+#endif
+
+			continue;
+		}
+
+		string body = converter::to_string(collect_metrics());
+		string response = fmt::format("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}", 
+			body.size(), body);
+
+		size_t offset = 0;
+		while (offset < response.size())
+		{
+			int sent = (int)send(session, response.data() + offset, (int)(response.size() - offset), 0);
+			if (sent <= 0)
+			{
+				break;
+			}
+
+			offset += sent;
+		}
+
+#ifdef _WIN32
+		closesocket(session);
+#else
+		close(session);
+#endif
+	}
+
+#ifdef _WIN32
+	closesocket((SOCKET)listener);
+	WSACleanup();
+#else
+	close((int)listener);
+#endif
+}
+
+// poll takes any descriptor, while an fd_set only holds descriptors below FD_SETSIZE
+// and a scrape of a server with many sessions usually gets a larger one
+bool wait_readable(const intptr_t& socket, const int& timeout)
+{
+#ifdef _WIN32
+	WSAPOLLFD target = { (SOCKET)socket, POLLRDNORM, 0 };
+
+	return WSAPoll(&target, 1, timeout) > 0;
+#else
+	pollfd target = { (int)socket, POLLIN, 0 };
+
+	return poll(&target, 1, timeout) > 0;
+#endif
+}
+
+wstring collect_metrics(void)
+{
+	uint64_t connected = _connected_sessions.load();
+	uint64_t disconnected = _disconnected_sessions.load();
+
+	return fmt::format(
+		L"# TYPE echo_server_pending_jobs gauge\necho_server_pending_jobs {}\n"
+		L"# TYPE echo_server_sessions gauge\necho_server_sessions {}\n"
+		L"# TYPE echo_server_connected_sessions_total counter\necho_server_connected_sessions_total {}\n"
+		L"# TYPE echo_server_expired_sessions_total counter\necho_server_expired_sessions_total {}\n"
+		L"# TYPE echo_server_received_messages_total counter\necho_server_received_messages_total {}\n"
+		L"# TYPE echo_server_received_binaries_total counter\necho_server_received_binaries_total {}\n"
+		L"# TYPE echo_server_received_binary_bytes_total counter\necho_server_received_binary_bytes_total {}\n"
+		L"# TYPE echo_server_sent_messages_total counter\necho_server_sent_messages_total {}\n"
+		L"# TYPE echo_server_sent_heartbeats_total counter\necho_server_sent_heartbeats_total {}\n",
+		_pending_jobs.load(memory_order_relaxed), connected - min(connected, disconnected), connected, _expired_sessions.load(), _received_messages.load(), 
+		_received_binaries.load(), _received_binary_bytes.load(), _sent_messages.load(), _sent_heartbeats.load())
+		+ _outbound_limiter.metrics()
+		+ _queue_wait.metrics(L"echo_server_queue_wait_seconds")
+		+ _handler_time.metrics(L"echo_server_handler_seconds");
 }
\ No newline at end of file
@@ -0,0 +1,631 @@
+﻿/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+#include <map>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+
+#include "logging.h"
+#include "converting.h"
+#include "file_handler.h"
+#include "argument_parser.h"
+#include "messaging_client.h"
+
+#include "container.h"
+#include "values/ullong_value.h"
+
+#include "fmt/xchar.h"
+#include "fmt/format.h"
+
+constexpr auto PROGRAM_NAME = L"replay_client";
+
+using namespace std;
+using namespace logging;
+using namespace network;
+using namespace container;
+using namespace converting;
+using namespace file_handler;
+using namespace argument_parser;
+
+bool encrypt_mode = false;
+bool compress_mode = false;
+bool binary_mode = false;
+unsigned short compress_block_size = 1024;
+#ifdef _DEBUG
+logging_level log_level = logging_level::parameter;
+logging_styles logging_style = logging_styles::console_only;
+#else
+logging_level log_level = logging_level::information;
+logging_styles logging_style = logging_styles::file_only;
+#endif
+wstring connection_key = L"echo_network";
+wstring server_ip = L"127.0.0.1";
+unsigned short server_port = 9876;
+unsigned short connection_count = 1;
+unsigned short replay_speed = 1;
+unsigned short reply_timeout = 10000;
+wstring capture_file = L"";
+
+struct capture_frame
+{
+	chrono::microseconds elapsed;
+	uint32_t session;
+	session_types type;
+	vector<uint8_t> payload;
+};
+
+struct replay_connection
+{
+	shared_ptr<messaging_client> client;
+	wstring target_id;
+	wstring target_sub_id;
+	deque<chrono::steady_clock::time_point> binary_sent;
+};
+
+vector<capture_frame> _frames;
+vector<replay_connection> _connections;
+
+mutex _replay_mutex;
+condition_variable _replay_condition;
+unsigned short _connected_count = 0;
+unsigned long long _last_replay_id = 0;
+unordered_map<unsigned long long, chrono::steady_clock::time_point> _message_sent;
+vector<chrono::microseconds> _latencies;
+size_t _skipped_frames = 0;
+map<wstring, size_t> _unreplied_frames;
+
+// echo_server only answers these message types to their sender,
+// so other captured messages like heartbeat or publish are sent without waiting for a reply
+const unordered_set<wstring> _replied_types = { L"echo_test", L"subscribe", L"unsubscribe" };
+
+bool parse_arguments(argument_manager& arguments);
+void display_help(void);
+
+bool load_capture(void);
+void create_clients(void);
+void create_client(const unsigned short& connection_index);
+bool wait_connections(void);
+void replay(void);
+bool send_frame(const capture_frame& frame);
+bool wait_replies(const size_t& replied_count);
+void write_statistics(const size_t& sent_count, const size_t& replied_count, const chrono::steady_clock::duration& elapsed);
+void connection(const unsigned short& connection_index, const wstring& target_id, const wstring& target_sub_id, const bool& condition);
+void received_message(shared_ptr<container::value_container> container);
+void received_binary_message(const unsigned short& connection_index, const wstring& source_id, const wstring& source_sub_id, 
+	const wstring& target_id, const wstring& target_sub_id, const vector<uint8_t>& data);
+
+int main(int argc, char* argv[])
+{
+	argument_manager arguments(argc, argv);
+	if (!parse_arguments(arguments))
+	{
+		return 0;
+	}
+
+	logger::handle().set_write_console(logging_style);
+	logger::handle().set_target_level(log_level);
+#ifdef _WIN32
+	logger::handle().start(PROGRAM_NAME, locale("ko_KR.UTF-8"));
+#else
+	logger::handle().start(PROGRAM_NAME);
+#endif
+
+	if (load_capture())
+	{
+		create_clients();
+
+		if (wait_connections())
+		{
+			replay();
+		}
+		else
+		{
+			logger::handle().write(logging_level::error, 
+				fmt::format(L"cannot connect {} clients to {}:{}", connection_count, server_ip, server_port));
+		}
+
+		for (auto& connection : _connections)
+		{
+			if (connection.client != nullptr)
+			{
+				connection.client->stop();
+			}
+		}
+		_connections.clear();
+	}
+
+	logger::handle().stop();
+
+	return 0;
+}
+
+bool parse_arguments(argument_manager& arguments)
+{
+	wstring temp;
+
+	auto string_target = arguments.to_string(L"--help");
+	if (string_target != nullopt)
+	{
+		display_help();
+
+		return false;
+	}
+
+	auto bool_target = arguments.to_bool(L"--encrypt_mode");
+	if (bool_target != nullopt)
+	{
+		encrypt_mode = *bool_target;
+	}
+
+	bool_target = arguments.to_bool(L"--compress_mode");
+	if (bool_target != nullopt)
+	{
+		compress_mode = *bool_target;
+	}
+
+	bool_target = arguments.to_bool(L"--binary_mode");
+	if (bool_target != nullopt)
+	{
+		binary_mode = *bool_target;
+	}
+
+	auto ushort_target = arguments.to_ushort(L"--compress_block_size");
+	if (ushort_target != nullopt)
+	{
+		compress_block_size = *ushort_target;
+	}
+
+	string_target = arguments.to_string(L"--connection_key");
+	if (string_target != nullopt)
+	{
+		temp = converter::to_wstring(file::load(*string_target));
+		if (!temp.empty())
+		{
+			connection_key = temp;
+		}
+	}
+
+	string_target = arguments.to_string(L"--server_ip");
+	if (string_target != nullopt)
+	{
+		server_ip = *string_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--server_port");
+	if (ushort_target != nullopt)
+	{
+		server_port = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--connection_count");
+	if (ushort_target != nullopt && *ushort_target > 0)
+	{
+		connection_count = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--replay_speed");
+	if (ushort_target != nullopt)
+	{
+		replay_speed = *ushort_target;
+	}
+
+	ushort_target = arguments.to_ushort(L"--reply_timeout");
+	if (ushort_target != nullopt)
+	{
+		reply_timeout = *ushort_target;
+	}
+
+	string_target = arguments.to_string(L"--capture_file");
+	if (string_target != nullopt)
+	{
+		capture_file = *string_target;
+	}
+
+	auto int_target = arguments.to_int(L"--logging_level");
+	if (int_target != nullopt)
+	{
+		log_level = (logging_level)*int_target;
+	}
+
+	bool_target = arguments.to_bool(L"--write_console_only");
+	if (bool_target != nullopt && *bool_target)
+	{
+		logging_style = logging_styles::console_only;
+
+		return true;
+	}
+
+	bool_target = arguments.to_bool(L"--write_console");
+	if (bool_target != nullopt && *bool_target)
+	{
+		logging_style = logging_styles::file_and_console;
+
+		return true;
+	}
+
+	logging_style = logging_styles::file_only;
+
+	return true;
+}
+
+void display_help(void)
+{
+	wcout << L"replay client options:" << endl << endl;
+	wcout << L"--capture_file [value]" << endl;
+	wcout << L"\tThe file recorded by echo_server with '--capture_file [file path]' to be replayed." << endl << endl;
+	wcout << L"--replay_speed [value]" << endl;
+	wcout << L"\tIf you want to replay faster than the capture must be appended '--replay_speed [times]'.\n\t'--replay_speed 0' sends every frame as fast as possible.\n\tInitialize value is --replay_speed 1." << endl << endl;
+	wcout << L"--connection_count [value]" << endl;
+	wcout << L"\tIf you want to spread the captured sessions over several connections must be appended '--connection_count [count]'.\n\tInitialize value is --connection_count 1." << endl << endl;
+	wcout << L"--reply_timeout [value]" << endl;
+	wcout << L"\tIf you want to change how long(ms) replies are waited for after the last frame must be appended\n\t'--reply_timeout [milliseconds]'.\n\tInitialize value is --reply_timeout 10000." << endl << endl;
+	wcout << L"--encrypt_mode [value] " << endl;
+	wcout << L"\tThe encrypt_mode on/off. If you want to use encrypt mode must be appended '--encrypt_mode true'.\n\tInitialize value is --encrypt_mode off." << endl << endl;
+	wcout << L"--compress_mode [value]" << endl;
+	wcout << L"\tThe compress_mode on/off. If you want to use compress mode must be appended '--compress_mode true'.\n\tInitialize value is --compress_mode off." << endl << endl;
+	wcout << L"--binary_mode [value]" << endl;
+	wcout << L"\tIf you want to replay the binary frames of a capture instead of the messages must be appended '--binary_mode true'.\n\tInitialize value is --binary_mode off." << endl << endl;
+	wcout << L"--connection_key [value]" << endl;
+	wcout << L"\tIf you want to change a specific key string for the connection to the main server must be appended\n\t'--connection_key [specific key string]'." << endl << endl;
+	wcout << L"--server_ip [value]" << endl;
+	wcout << L"\tIf you want to change a server ip address for the connection to the main server must be appended\n\t'--server_ip [server ip address]'." << endl << endl;
+	wcout << L"--server_port [value]" << endl;
+	wcout << L"\tIf you want to change a port number for the connection to the main server must be appended\n\t'--server_port [port number]'." << endl << endl;
+	wcout << L"--write_console [value] " << endl;
+	wcout << L"\tThe write_console_mode on/off. If you want to display log on console must be appended '--write_console true'.\n\tInitialize value is --write_console off." << endl << endl;
+	wcout << L"--logging_level [value]" << endl;
+	wcout << L"\tIf you want to change log level must be appended '--logging_level [level]'." << endl;
+}
+
+bool load_capture(void)
+{
+	vector<uint8_t> data = file::load(capture_file);
+	if (data.size() < 4 || memcmp(data.data(), "ECAP", 4) != 0)
+	{
+		logger::handle().write(logging_level::error, fmt::format(L"{} is not a capture file of echo_server", capture_file));
+
+		return false;
+	}
+
+	// frames are [elapsed microseconds: 8][session index: 4][session type: 1][payload size: 4][payload]
+	size_t offset = 4;
+	auto read = [&data, &offset](void* target, const size_t& size) -> bool
+	{
+		if (offset + size > data.size())
+		{
+			return false;
+		}
+
+		memcpy(target, data.data() + offset, size);
+		offset += size;
+
+		return true;
+	};
+
+	uint64_t elapsed = 0;
+	uint32_t session = 0;
+	uint8_t type = 0;
+	uint32_t size = 0;
+	while (read(&elapsed, sizeof(elapsed)) && read(&session, sizeof(session)) && read(&type, sizeof(type)) && read(&size, sizeof(size)))
+	{
+		if (offset + size > data.size())
+		{
+			break;
+		}
+
+		if ((session_types)type != (binary_mode ? session_types::binary_line : session_types::message_line))
+		{
+			++_skipped_frames;
+			offset += size;
+
+			continue;
+		}
+
+		_frames.push_back({ chrono::microseconds(elapsed), session, (session_types)type,
+			vector<uint8_t>(data.begin() + offset, data.begin() + offset + size) });
+		offset += size;
+	}
+
+	logger::handle().write(logging_level::information,
+		fmt::format(L"loaded {} frames from {} ({} frames of the other session type are skipped)", 
+			_frames.size(), capture_file, _skipped_frames));
+
+	return !_frames.empty();
+}
+
+void create_clients(void)
+{
+	_connections.clear();
+	_connections.resize(connection_count);
+
+	for (unsigned short connection_index = 0; connection_index < connection_count; ++connection_index)
+	{
+		create_client(connection_index);
+	}
+}
+
+void create_client(const unsigned short& connection_index)
+{
+	auto client = make_shared<messaging_client>(PROGRAM_NAME);
+	client->set_encrypt_mode(encrypt_mode);
+	client->set_compress_mode(compress_mode);
+	client->set_compress_block_size(compress_block_size);
+	client->set_connection_key(connection_key);
+	client->set_connection_notification(
+		[connection_index](const wstring& target_id, const wstring& target_sub_id, const bool& condition)
+		{
+			connection(connection_index, target_id, target_sub_id, condition);
+		});
+	if (binary_mode)
+	{
+		client->set_binary_notification(
+			[connection_index](const wstring& source_id, const wstring& source_sub_id, 
+				const wstring& target_id, const wstring& target_sub_id, const vector<uint8_t>& data)
+			{
+				received_binary_message(connection_index, source_id, source_sub_id, target_id, target_sub_id, data);
+			});
+		client->set_session_types({ session_types::binary_line });
+	}
+	else
+	{
+		client->set_message_notification(&received_message);
+		client->set_session_types({ session_types::message_line });
+	}
+
+	{
+		scoped_lock<mutex> guard(_replay_mutex);
+
+		_connections[connection_index].client = client;
+	}
+
+	client->start(server_ip, server_port);
+}
+
+bool wait_connections(void)
+{
+	unique_lock<mutex> lock(_replay_mutex);
+
+	return _replay_condition.wait_for(lock, chrono::milliseconds(reply_timeout), 
+		[]() { return _connected_count == connection_count; });
+}
+
+void replay(void)
+{
+	// each captured session is replayed on the connection of its index,
+	// and the captured timing from the first frame on is kept unless --replay_speed 0 is given,
+	// so the time the server was idle before its first frame is not waited again
+	auto started = chrono::steady_clock::now();
+	auto first_elapsed = _frames.front().elapsed;
+
+	size_t sent_count = 0;
+	size_t replied_count = 0;
+	for (auto& frame : _frames)
+	{
+		if (replay_speed > 0)
+		{
+			this_thread::sleep_until(started + (frame.elapsed - first_elapsed) / replay_speed);
+		}
+
+		if (send_frame(frame))
+		{
+			++replied_count;
+		}
+		++sent_count;
+	}
+
+	bool replied = wait_replies(replied_count);
+
+	write_statistics(sent_count, replied_count, chrono::steady_clock::now() - started);
+
+	if (!replied)
+	{
+		logger::handle().write(logging_level::error,
+			fmt::format(L"{} of {} frames are not answered in {} ms", replied_count - _latencies.size(), replied_count, reply_timeout));
+	}
+}
+
+// returns true if echo_server answers the frame
+bool send_frame(const capture_frame& frame)
+{
+	unsigned short connection_index = (unsigned short)(frame.session % connection_count);
+	auto& connection = _connections[connection_index];
+
+	if (frame.type == session_types::binary_line)
+	{
+		{
+			scoped_lock<mutex> guard(_replay_mutex);
+
+			connection.binary_sent.push_back(chrono::steady_clock::now());
+		}
+
+		connection.client->send_binary(connection.target_id, connection.target_sub_id, frame.payload);
+
+		return true;
+	}
+
+	// the captured source is the recorded session, so it is cleared for messaging_client to fill in this connection
+	// and the reply of echo_server comes back here instead of to the recorded session
+	auto container = make_shared<value_container>(frame.payload, false);
+	container->set_source(L"", L"");
+	container->set_target(connection.target_id, connection.target_sub_id);
+
+	if (_replied_types.find(container->message_type()) == _replied_types.end())
+	{
+		++_unreplied_frames[container->message_type()];
+		connection.client->send(container);
+
+		return false;
+	}
+
+	// the captured message is sent to this server with a replay_id,
+	// which comes back in the echo to measure its latency
+	unsigned long long replay_id = 0;
+	{
+		scoped_lock<mutex> guard(_replay_mutex);
+
+		replay_id = ++_last_replay_id;
+		_message_sent.insert({ replay_id, chrono::steady_clock::now() });
+	}
+
+	container->remove(L"replay_id");
+	container->add(ullong_value(L"replay_id", replay_id));
+
+	connection.client->send(container);
+
+	return true;
+}
+
+bool wait_replies(const size_t& replied_count)
+{
+	unique_lock<mutex> lock(_replay_mutex);
+
+	return _replay_condition.wait_for(lock, chrono::milliseconds(reply_timeout), 
+		[&replied_count]() { return _latencies.size() >= replied_count; });
+}
+
+void write_statistics(const size_t& sent_count, const size_t& replied_count, const chrono::steady_clock::duration& elapsed)
+{
+	scoped_lock<mutex> guard(_replay_mutex);
+
+	for (auto& frames : _unreplied_frames)
+	{
+		logger::handle().write(logging_level::information,
+			fmt::format(L"replayed {} {} frames which are not answered", frames.second, frames.first));
+	}
+
+	double seconds = chrono::duration<double>(elapsed).count();
+	if (_latencies.empty())
+	{
+		logger::handle().write(logging_level::information,
+			fmt::format(L"replayed {} frames in {:.3f} s without any reply to {} frames", sent_count, seconds, replied_count));
+
+		return;
+	}
+
+	sort(_latencies.begin(), _latencies.end());
+
+	auto percentile = [](const double& rate) -> long long
+	{
+		return _latencies[(size_t)((_latencies.size() - 1) * rate)].count();
+	};
+
+	logger::handle().write(logging_level::information,
+		fmt::format(L"replayed {} frames to {}:{} in {:.3f} s ({:.1f} frames/s), {} of {} replies, latency(us) p50: {}, p90: {}, p99: {}, p99.9: {}, max: {}",
+			sent_count, server_ip, server_port, seconds, seconds > 0 ? sent_count / seconds : 0.0, _latencies.size(), replied_count,
+			percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), _latencies.back().count()));
+}
+
+void connection(const unsigned short& connection_index, const wstring& target_id, const wstring& target_sub_id, const bool& condition)
+{
+	logger::handle().write(logging_level::information,
+		fmt::format(L"a replay_client[{}]({}[{}]) is {} an echo_server", connection_index, target_id, target_sub_id,
+			condition ? L"connected to" : L"disconnected from"));
+
+	if (!condition)
+	{
+		return;
+	}
+
+	{
+		scoped_lock<mutex> guard(_replay_mutex);
+
+		auto& connection = _connections[connection_index];
+		connection.target_id = target_id;
+		connection.target_sub_id = target_sub_id;
+		++_connected_count;
+	}
+
+	_replay_condition.notify_all();
+}
+
+void received_message(shared_ptr<container::value_container> container)
+{
+	if (container == nullptr)
+	{
+		return;
+	}
+
+	auto replay_id = container->value_array(L"replay_id");
+	if (replay_id.empty())
+	{
+		logger::handle().write(logging_level::sequence,
+			fmt::format(L"received message without replay_id: {}", container->message_type()));
+
+		return;
+	}
+
+	{
+		scoped_lock<mutex> guard(_replay_mutex);
+
+		auto target = _message_sent.find(replay_id[0]->to_ullong());
+		if (target == _message_sent.end())
+		{
+			return;
+		}
+
+		_latencies.push_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - target->second));
+		_message_sent.erase(target);
+	}
+
+	_replay_condition.notify_all();
+}
+
+void received_binary_message(const unsigned short& connection_index, const wstring& source_id, const wstring& source_sub_id, 
+	const wstring& target_id, const wstring& target_sub_id, const vector<uint8_t>& data)
+{
+	// echo_server returns binary frames of a session in order, so the oldest one sent is the one answered
+	{
+		scoped_lock<mutex> guard(_replay_mutex);
+
+		auto& binary_sent = _connections[connection_index].binary_sent;
+		if (binary_sent.empty())
+		{
+			return;
+		}
+
+		_latencies.push_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - binary_sent.front()));
+		binary_sent.pop_front();
+	}
+
+	_replay_condition.notify_all();
+}
\ No newline at end of file
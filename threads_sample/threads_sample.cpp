@@ -31,6 +31,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *****************************************************************************/
 
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <list>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
 
 #include "logging.h"
 #include "thread_pool.h"
@@ -42,6 +50,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "argument_parser.h"
 
+#include "fmt/xchar.h"
 #include "fmt/format.h"
 
 constexpr auto PROGRAM_NAME = L"thread_sample";
@@ -58,6 +67,8 @@ logging_styles logging_style = logging_styles::console_only;
 logging_level log_level = logging_level::information;
 logging_styles logging_style = logging_styles::file_only;
 #endif
+unsigned short aging_threshold = 0;
+chrono::steady_clock::time_point _started;
 
 bool parse_arguments(argument_manager& arguments);
 void display_help(void);
@@ -82,6 +93,56 @@ void write_low(void)
 	write_data(converter::to_array(L"테스트2_low_in_thread"));
 }
 
+class wait_statistics
+{
+public:
+	void record(const priorities& origin, const priorities& priority, const chrono::microseconds& waited)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		_waits[{ origin, priority }].push_back(waited);
+	}
+
+	void write(void)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		for (auto& waits : _waits)
+		{
+			if (waits.second.empty())
+			{
+				continue;
+			}
+
+			sort(waits.second.begin(), waits.second.end());
+			logger::handle().write(logging_level::information,
+				fmt::format(L"{} priority ran as {} waited(us) p50: {}, p99: {}, max: {} on {} jobs",
+					priority_name(waits.first.first), priority_name(waits.first.second),
+					waits.second[(waits.second.size() - 1) / 2].count(),
+					waits.second[(size_t)((waits.second.size() - 1) * 0.99)].count(),
+					waits.second.back().count(), waits.second.size()));
+		}
+	}
+
+private:
+	wstring priority_name(const priorities& priority)
+	{
+		switch (priority)
+		{
+		case priorities::high: return L"high";
+		case priorities::normal: return L"normal";
+		case priorities::low: return L"low";
+		default: return L"unknown";
+		}
+	}
+
+private:
+	mutex _mutex;
+	map<pair<priorities, priorities>, vector<chrono::microseconds>> _waits;
+};
+
+wait_statistics _wait_statistics;
+
 class saving_test_job : public job
 {
 public:
@@ -97,24 +158,57 @@ protected:
 	}
 };
 
+// shared by every copy of a test_job_without_data, so only the first copy to run does its work
+struct job_ticket
+{
+	job_ticket(const priorities& priority) : origin(priority), enqueued(chrono::steady_clock::now())
+	{
+	}
+
+	priorities origin;
+	chrono::steady_clock::time_point enqueued;
+	atomic<bool> claimed{ false };
+};
+
 class test_job_without_data : public job
 {
 public:
-	test_job_without_data(const priorities& priority) : job(priority)
+	test_job_without_data(const priorities& priority) 
+		: job(priority), _ticket(make_shared<job_ticket>(priority))
+	{
+	}
+
+	test_job_without_data(const priorities& priority, shared_ptr<job_ticket> ticket) 
+		: job(priority), _ticket(ticket)
+	{
+	}
+
+	shared_ptr<job_ticket> ticket(void) const
 	{
+		return _ticket;
 	}
 
 protected:
 	void working(const priorities& worker_priority) override
 	{
+		// a copy pushed at another priority by the aging_watchdog has already run
+		if (_ticket->claimed.exchange(true))
+		{
+			return;
+		}
+
+		// jobs pushed before start() only begin to wait when the workers start
+		auto waited = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - max(_ticket->enqueued, _started));
+		_wait_statistics.record(_ticket->origin, priority(), waited);
+
 		auto pool = _job_pool.lock();
 		if (pool != nullptr)
 		{
-			pool->push(make_shared<job>(priority(), 
+			pool->push(make_shared<job>(_ticket->origin, 
 				converter::to_array(L"테스트5_in_thread"), &write_data));
 		}
 
-		switch (priority())
+		switch (_ticket->origin)
 		{
 		case priorities::high: 
 			logger::handle().write(logging_level::information, L"테스트4_high_in_thread");
@@ -129,8 +223,99 @@ protected:
 			break;
 		}
 	}
+
+private:
+	shared_ptr<job_ticket> _ticket;
 };
 
+// ages the test jobs which are still queued: a job which waited longer than aging_threshold
+// at its priority is pushed again one level higher, and the copy which runs first claims the ticket.
+// The copy left behind returns at once when its worker takes it.
+class aging_watchdog
+{
+public:
+	~aging_watchdog(void)
+	{
+		stop();
+	}
+
+	void watch(shared_ptr<job_ticket> ticket)
+	{
+		scoped_lock<mutex> guard(_mutex);
+
+		_tickets.push_back({ ticket, ticket->origin, ticket->enqueued });
+	}
+
+	void start(thread_pool& manager)
+	{
+		_stop = false;
+		_thread = thread(&aging_watchdog::run, this, ref(manager));
+	}
+
+	void stop(void)
+	{
+		{
+			scoped_lock<mutex> guard(_mutex);
+
+			_stop = true;
+		}
+
+		_condition.notify_one();
+
+		if (_thread.joinable())
+		{
+			_thread.join();
+		}
+	}
+
+private:
+	struct watched
+	{
+		shared_ptr<job_ticket> ticket;
+		priorities priority;
+		chrono::steady_clock::time_point pushed;
+	};
+
+	void run(thread_pool& manager)
+	{
+		auto threshold = chrono::milliseconds(aging_threshold);
+		auto interval = max(chrono::milliseconds(1), threshold / 4);
+
+		unique_lock<mutex> lock(_mutex);
+		while (!_condition.wait_for(lock, interval, [this]() { return _stop; }))
+		{
+			auto now = chrono::steady_clock::now();
+			for (auto target = _tickets.begin(); target != _tickets.end();)
+			{
+				if (target->ticket->claimed.load() || target->priority == priorities::high)
+				{
+					target = _tickets.erase(target);
+
+					continue;
+				}
+
+				if (now - max(target->pushed, _started) >= threshold)
+				{
+					target->priority = (target->priority == priorities::low) ? priorities::normal : priorities::high;
+					target->pushed = now;
+					manager.push(make_shared<test_job_without_data>(target->priority, target->ticket));
+				}
+
+				++target;
+			}
+		}
+	}
+
+private:
+	mutex _mutex;
+	condition_variable _condition;
+	bool _stop = true;
+	list<watched> _tickets;
+	thread _thread;
+};
+
+aging_watchdog _aging_watchdog;
+
 int main(int argc, char* argv[])
 {
 	argument_manager arguments(argc, argv);
@@ -182,13 +367,28 @@ int main(int argc, char* argv[])
 	// derived job without data
 	for (unsigned int log_index = 0; log_index < 1000; ++log_index)
 	{
-		manager.push(make_shared<test_job_without_data>(priorities::high));
-		manager.push(make_shared<test_job_without_data>(priorities::normal));
-		manager.push(make_shared<test_job_without_data>(priorities::low));
+		for (auto& priority : { priorities::high, priorities::normal, priorities::low })
+		{
+			auto test_job = make_shared<test_job_without_data>(priority);
+			if (aging_threshold > 0)
+			{
+				_aging_watchdog.watch(test_job->ticket());
+			}
+
+			manager.push(test_job);
+		}
 	}
 
+	_started = chrono::steady_clock::now();
+	if (aging_threshold > 0)
+	{
+		_aging_watchdog.start(manager);
+	}
 	manager.start();
 	manager.stop(false);
+	_aging_watchdog.stop();
+
+	_wait_statistics.write();
 
 	logger::handle().stop();
 
@@ -207,6 +407,12 @@ bool parse_arguments(argument_manager& arguments)
 		return false;
 	}
 
+	auto ushort_target = arguments.to_ushort(L"--aging_threshold");
+	if (ushort_target != nullopt)
+	{
+		aging_threshold = *ushort_target;
+	}
+
 	auto int_target = arguments.to_int(L"--logging_level");
 	if (int_target != nullopt)
 	{
@@ -237,6 +443,8 @@ bool parse_arguments(argument_manager& arguments)
 void display_help(void)
 {
 	wcout << L"download sample options:" << endl << endl;
+	wcout << L"--aging_threshold [value]" << endl;
+	wcout << L"\tIf you want to push a derived job without data one priority higher for every threshold(ms) it is still queued\n\tmust be appended '--aging_threshold [milliseconds]'. Only the first copy of a job to run does its work.\n\tInitialize value is --aging_threshold 0(off)." << endl << endl;
 	wcout << L"--write_console [value] " << endl;
 	wcout << L"\tThe write_console_mode on/off. If you want to display log on console must be appended '--write_console true'.\n\tInitialize value is --write_console off." << endl << endl;
 	wcout << L"--logging_level [value]" << endl;